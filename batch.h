@@ -0,0 +1,305 @@
+#pragma once
+
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QMutex>
+#include <QSaveFile>
+#include <QTextStream>
+#include <QThread>
+#include <vector>
+
+#include "batchpipeline.h"
+#include "collageworker.h"
+
+// Headless driver for render servers: reads collage manifests and runs
+// them through a BatchPipeline, with no widgets and no display. Started by
+// main() with --batch.
+//
+// A manifest is either JSON:
+//   {"gridSize": 3, "maxSize": 4000, "output": "out.png", "preset": "balanced",
+//    "filter": "lanczos3", "cells": [{"row": 0, "col": 0, "path": "a.jpg"}, ...]}
+// or CSV with one "row,col,path" line per cell. "rows" and "cols" instead
+// of "gridSize" give a grid that is not square, "width" and "height" an
+// exact output size in place of maxSize. Relative paths are taken from the
+// manifest's directory. The GUI saves its projects as JSON manifests, with
+// each cell's sourceSize and disk cache key added. Every option given on
+// the command line (--grid, --rows, --cols, --max-size, --width, --height,
+// --preset, --filter, --output) replaces the manifest's value; what
+// neither sets has defaults: the smallest square grid holding all cells
+// and the output named after the manifest with a .png suffix.
+class BatchRunner {
+public:
+    using Cell = BatchCell;
+    using Job = BatchJob;
+
+    int run(const QStringList& arguments) {
+        QCommandLineParser parser;
+        parser.setApplicationDescription("Сборка коллажей по манифестам без окна");
+        parser.addHelpOption();
+        QCommandLineOption batchOption("batch", "Пакетный режим без окна.");
+        QCommandLineOption jobsOption("jobs", "Сколько коллажей собирать одновременно.", "N",
+                                      QString::number(std::max(1, QThread::idealThreadCount() / 4)));
+        QCommandLineOption gridOption("grid", "Размер сетки, вместо заданного в манифесте.", "N");
+        QCommandLineOption rowsOption("rows", "Число строк сетки.", "N");
+        QCommandLineOption colsOption("cols", "Число столбцов сетки.", "N");
+        QCommandLineOption maxSizeOption("max-size", "Максимальная сторона коллажа, px.", "PX");
+        QCommandLineOption widthOption("width", "Точная ширина коллажа, px (вместе с --height).", "PX");
+        QCommandLineOption heightOption("height", "Точная высота коллажа, px (вместе с --width).", "PX");
+        QCommandLineOption outputOption("output", "Файл результата (только для одного манифеста).", "FILE");
+        QCommandLineOption presetOption("preset", "Сжатие: fast, balanced или smallest.", "NAME");
+        QCommandLineOption filterOption("filter", "Фильтр: lanczos3, bicubic или box.", "NAME");
+        QCommandLineOption decodeOption("decode-threads", "Потоки чтения исходников.", "N", "4");
+        QCommandLineOption writeOption("write-threads", "Потоки записи готовых коллажей.", "N", "1");
+        QCommandLineOption queueOption("queue", "Сколько коллажей ждут между стадиями.", "N", "2");
+        QCommandLineOption memoryOption("memory", "Память под декодированные исходники, МБ.", "MB", "4096");
+        QCommandLineOption cacheOption("cache-dir", "Каталог кэша тайлов между запусками.", "DIR");
+        parser.addOptions({batchOption, jobsOption, gridOption, rowsOption, colsOption, maxSizeOption,
+                           widthOption, heightOption, outputOption, presetOption, filterOption, decodeOption,
+                           writeOption, queueOption, memoryOption, cacheOption});
+        parser.addPositionalArgument("manifests", "JSON или CSV манифесты.", "manifest...");
+        parser.process(arguments);
+
+        QTextStream err(stderr);
+        const QStringList manifests = parser.positionalArguments();
+        if (manifests.isEmpty()) {
+            err << "Не указан ни один манифест\n";
+            return 2;
+        }
+        if (parser.isSet(outputOption) && manifests.size() > 1) {
+            err << "--output можно задать только для одного манифеста\n";
+            return 2;
+        }
+
+        std::vector<Job> jobs;
+        int failed = 0;
+        for (const QString& manifest : manifests) {
+            Job job;
+            job.manifestPath = manifest;
+            QString error;
+            bool loaded = readManifest(job, &error);
+            if (loaded) {
+                // Explicit options win over the manifest
+                if (parser.isSet(gridOption)) job.rows = job.cols = parser.value(gridOption).toInt();
+                if (parser.isSet(rowsOption)) job.rows = parser.value(rowsOption).toInt();
+                if (parser.isSet(colsOption)) job.cols = parser.value(colsOption).toInt();
+                if (parser.isSet(maxSizeOption)) job.maxSize = parser.value(maxSizeOption).toInt();
+                if (parser.isSet(widthOption)) job.width = parser.value(widthOption).toInt();
+                if (parser.isSet(heightOption)) job.height = parser.value(heightOption).toInt();
+                if (parser.isSet(presetOption)) job.preset = parser.value(presetOption);
+                if (parser.isSet(filterOption)) job.filter = parser.value(filterOption);
+                if (parser.isSet(outputOption)) job.outputPath = parser.value(outputOption);
+                loaded = resolveJob(job, &error);
+            }
+            if (!loaded) {
+                err << "FAIL " << manifest << ": " << error << "\n";
+                failed++;
+                continue;
+            }
+            jobs.push_back(job);
+        }
+        err.flush();
+
+        std::shared_ptr<DiskCache> diskCache;
+        if (parser.isSet(cacheOption)) {
+            diskCache = std::make_shared<DiskCache>(parser.value(cacheOption), 8LL * 1024 * 1024 * 1024);
+        }
+
+        BatchPipeline::Settings settings;
+        settings.decodeThreads = parser.value(decodeOption).toInt();
+        settings.renderJobs = parser.value(jobsOption).toInt();
+        settings.writeThreads = parser.value(writeOption).toInt();
+        settings.queueDepth = parser.value(queueOption).toInt();
+        settings.memoryBudget = parser.value(memoryOption).toLongLong() * 1024 * 1024;
+        settings.diskCache = diskCache;
+
+        QMutex outputMutex;
+        QAtomicInt failures = failed;
+        BatchPipeline(settings).run(jobs, [&](const Job& job, bool ok, const QString& message) {
+            QMutexLocker locker(&outputMutex);
+            QTextStream out(ok ? stdout : stderr);
+            if (ok) {
+                out << "OK " << job.outputPath << "\n";
+            } else {
+                out << "FAIL " << job.manifestPath << ": " << message << "\n";
+                failures.fetchAndAddRelaxed(1);
+            }
+        });
+        if (diskCache) {
+            diskCache->trim();
+        }
+
+        return failures.loadAcquire() == 0 ? 0 : 1;
+    }
+
+    // Fills job from the file at job.manifestPath
+    static bool readManifest(Job& job, QString* error) {
+        QFile file(job.manifestPath);
+        if (!file.open(QIODevice::ReadOnly)) {
+            *error = file.errorString();
+            return false;
+        }
+        const QByteArray content = file.readAll();
+        return QFileInfo(job.manifestPath).suffix().toLower() == "json"
+            ? parseJson(content, job, error)
+            : parseCsv(content, job, error);
+    }
+
+    // Checks the settings and makes paths absolute
+    static bool resolveJob(Job& job, QString* error) {
+        const QFileInfo manifestInfo(job.manifestPath);
+        const QDir baseDir = manifestInfo.absoluteDir();
+        if (job.cells.empty()) {
+            *error = "Манифест не содержит ни одной ячейки";
+            return false;
+        }
+        int fitRows = 0;
+        int fitCols = 0;
+        for (Cell& cell : job.cells) {
+            if (cell.row < 0 || cell.col < 0) {
+                *error = QString("Неверная ячейка %1,%2").arg(cell.row).arg(cell.col);
+                return false;
+            }
+            fitRows = std::max(fitRows, cell.row + 1);
+            fitCols = std::max(fitCols, cell.col + 1);
+            if (QFileInfo(cell.path).isRelative()) {
+                cell.path = baseDir.filePath(cell.path);
+            }
+        }
+        // Square unless one side is given
+        if (job.rows <= 0 && job.cols <= 0) {
+            job.rows = job.cols = std::max(fitRows, fitCols);
+        }
+        if (job.rows <= 0) job.rows = fitRows;
+        if (job.cols <= 0) job.cols = fitCols;
+        if (fitRows > job.rows || fitCols > job.cols) {
+            *error = QString("Ячейки не помещаются в сетку %1x%2").arg(job.rows).arg(job.cols);
+            return false;
+        }
+        if ((job.width > 0) != (job.height > 0)) {
+            *error = "Ширина и высота коллажа задаются только вместе";
+            return false;
+        }
+        if (job.width > 0 && (job.width < job.cols || job.height < job.rows)) {
+            *error = QString("Слишком маленький размер коллажа %1x%2").arg(job.width).arg(job.height);
+            return false;
+        }
+        if (job.width <= 0 && job.maxSize < std::max(job.rows, job.cols)) {
+            *error = QString("Слишком маленький максимальный размер %1").arg(job.maxSize);
+            return false;
+        }
+
+        if (job.outputPath.isEmpty()) {
+            job.outputPath = baseDir.filePath(manifestInfo.completeBaseName() + ".png");
+        } else if (QFileInfo(job.outputPath).isRelative()) {
+            job.outputPath = baseDir.filePath(job.outputPath);
+        }
+
+        if (job.preset != "fast" && job.preset != "balanced" && job.preset != "smallest") {
+            *error = QString("Неизвестный режим сжатия %1").arg(job.preset);
+            return false;
+        }
+        Resampler::Filter filter;
+        if (!Resampler::filterFromName(job.filter, &filter)) {
+            *error = QString("Неизвестный фильтр %1").arg(job.filter);
+            return false;
+        }
+        return true;
+    }
+
+    // JSON manifest with everything in job; paths are written as they are
+    static bool writeManifest(const Job& job, const QString& path, QString* error) {
+        QJsonObject root;
+        if (job.rows == job.cols) {
+            root.insert("gridSize", job.rows);
+        } else {
+            root.insert("rows", job.rows);
+            root.insert("cols", job.cols);
+        }
+        root.insert("maxSize", job.maxSize);
+        if (job.width > 0) {
+            root.insert("width", job.width);
+            root.insert("height", job.height);
+        }
+        if (!job.outputPath.isEmpty()) root.insert("output", job.outputPath);
+        root.insert("preset", job.preset);
+        root.insert("filter", job.filter);
+        QJsonArray cells;
+        for (const Cell& cell : job.cells) {
+            QJsonObject object;
+            object.insert("row", cell.row);
+            object.insert("col", cell.col);
+            object.insert("path", cell.path);
+            if (cell.sourceSize > 0) object.insert("sourceSize", cell.sourceSize);
+            if (!cell.key.isEmpty()) object.insert("key", cell.key);
+            cells.append(object);
+        }
+        root.insert("cells", cells);
+
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly) ||
+            file.write(QJsonDocument(root).toJson()) < 0 || !file.commit()) {
+            *error = file.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    // Fills job from the content of a JSON manifest
+    static bool parseJson(const QByteArray& content, Job& job, QString* error) {
+        QJsonParseError parseError;
+        QJsonDocument document = QJsonDocument::fromJson(content, &parseError);
+        if (!document.isObject()) {
+            *error = parseError.errorString();
+            return false;
+        }
+        QJsonObject root = document.object();
+        job.rows = job.cols = root.value("gridSize").toInt(0);
+        job.rows = root.value("rows").toInt(job.rows);
+        job.cols = root.value("cols").toInt(job.cols);
+        job.maxSize = root.value("maxSize").toInt(job.maxSize);
+        job.width = root.value("width").toInt(0);
+        job.height = root.value("height").toInt(0);
+        job.outputPath = root.value("output").toString();
+        if (root.contains("preset")) job.preset = root.value("preset").toString();
+        if (root.contains("filter")) job.filter = root.value("filter").toString();
+
+        for (const QJsonValue& value : root.value("cells").toArray()) {
+            QJsonObject cell = value.toObject();
+            job.cells.push_back({cell.value("row").toInt(-1), cell.value("col").toInt(-1),
+                                 cell.value("path").toString(), cell.value("sourceSize").toInt(0),
+                                 cell.value("key").toString()});
+        }
+        return true;
+    }
+
+private:
+    // "row,col,path" per line; the path may itself contain commas. Blank
+    // lines, '#' comments and a header line are skipped.
+    static bool parseCsv(const QByteArray& content, Job& job, QString* error) {
+        const QStringList lines = QString::fromUtf8(content).split('\n');
+        for (int i = 0; i < lines.size(); i++) {
+            QString line = lines[i].trimmed();
+            if (line.isEmpty() || line.startsWith("#")) {
+                continue;
+            }
+            QStringList fields = line.split(',');
+            bool rowOk = false, colOk = false;
+            int row = fields.value(0).trimmed().toInt(&rowOk);
+            int col = fields.value(1).trimmed().toInt(&colOk);
+            if (!rowOk || !colOk || fields.size() < 3) {
+                if (i == 0) {
+                    continue; // header
+                }
+                *error = QString("Строка %1: ожидается row,col,path").arg(i + 1);
+                return false;
+            }
+            job.cells.push_back({row, col, line.section(',', 2).trimmed(), 0, QString()});
+        }
+        return true;
+    }
+};
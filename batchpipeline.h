@@ -0,0 +1,342 @@
+#pragma once
+
+#include <QByteArray>
+#include <QImageReader>
+#include <QMutex>
+#include <QSaveFile>
+#include <QSemaphore>
+#include <QString>
+#include <QThreadPool>
+#include <QtConcurrent>
+#include <atomic>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <numeric>
+#include <set>
+#include <vector>
+
+#include "collageworker.h"
+
+struct BatchCell {
+    int row;
+    int col;
+    QString path;
+    int sourceSize = 0;  // side of the source's center square, 0 if unknown
+    QString key;         // DiskCache key of its decoded square, if any
+};
+
+struct BatchJob {
+    QString manifestPath;
+    int rows = 0;
+    int cols = 0;
+    int maxSize = 4000;
+    int width = 0;       // output size, 0 x 0 to plan it from maxSize
+    int height = 0;
+    QString outputPath;
+    QString preset = "balanced";
+    QString filter = "lanczos3";
+    std::vector<BatchCell> cells;
+};
+
+// Runs many collages through three stages with their own thread pools:
+// decode (I/O-bound), render (compose + encode, CPU-bound, the compose
+// itself still spreads over the global pool) and write. Backpressure
+// between the stages: a collage starts decoding only while the decoded
+// sources of the collages in flight fit memoryBudget, and a render waits
+// while queueDepth encoded collages are waiting for the disk. So collage
+// N+1 decodes while N encodes and N-1 is written.
+//
+// Every source is decoded for each tile shape it is used with, at the
+// largest size any collage wants it, and shared by the collages in flight
+// that use it; it is let go when none of them is left, and decoded again
+// for a later one. Streamed collages (CollageWorker::isStreamed) get only
+// their sources' sizes from the file headers: their worker decodes each
+// grid row's sources while composing it, so a 40000 px collage never holds
+// all of them at once.
+class BatchPipeline {
+public:
+    struct Settings {
+        int decodeThreads = 4;
+        int renderJobs = 1;
+        int writeThreads = 1;
+        int queueDepth = 2;
+        qint64 memoryBudget = 4096LL * 1024 * 1024;  // decoded sources in flight
+        std::shared_ptr<DiskCache> diskCache;
+    };
+
+    // Called once per job from a pool thread, not serialized
+    using Report = std::function<void(const BatchJob& job, bool ok, const QString& message)>;
+
+    explicit BatchPipeline(const Settings& settings) : settings(settings) {
+        decodePool.setMaxThreadCount(std::max(1, settings.decodeThreads));
+        renderPool.setMaxThreadCount(std::max(1, settings.renderJobs));
+        writePool.setMaxThreadCount(std::max(1, settings.writeThreads));
+    }
+
+    // Returns once every job has been written or has failed
+    void run(const std::vector<BatchJob>& jobs, const Report& report) {
+        if (jobs.empty()) {
+            return;
+        }
+        std::vector<std::unique_ptr<JobState>> states;
+        for (const BatchJob& job : jobs) {
+            states.emplace_back(new JobState(job));
+            states.back()->streamed = isStreamed(job);
+        }
+        planSources(states);
+
+        // In MB, so any budget fits the semaphore's int
+        const int budget = static_cast<int>(std::min<qint64>(std::max<qint64>(settings.memoryBudget >> 20, 1),
+                                                             std::numeric_limits<int>::max()));
+        QSemaphore memory(budget);
+        QSemaphore writeSlots(std::max(1, settings.queueDepth));
+        QSemaphore done;
+
+        for (auto& owned : states) {
+            JobState* state = owned.get();
+            // A job larger than the whole budget runs alone
+            state->memoryUnits = static_cast<int>(std::min<qint64>((heldBytes(*state) + (1 << 20) - 1) >> 20, budget));
+            memory.acquire(state->memoryUnits); // backpressure from the render stage
+            auto submitRender = [this, state, &memory, &writeSlots, &done, &report]() {
+                QtConcurrent::run(&renderPool, [this, state, &memory, &writeSlots, &done, &report]() {
+                    render(*state, memory, writeSlots, done, report);
+                });
+            };
+            if (state->job.cells.empty()) {
+                submitRender(); // the worker reports the empty grid
+                continue;
+            }
+            if (!state->streamed) {
+                hold(state->job);
+            }
+            // The last decoded cell of a collage hands it to the render stage
+            state->pending = static_cast<int>(state->job.cells.size());
+            for (size_t i = 0; i < state->job.cells.size(); i++) {
+                QtConcurrent::run(&decodePool, [this, state, i, submitRender]() {
+                    const BatchCell& cell = state->job.cells[i];
+                    if (state->streamed) {
+                        // The header is enough to plan, the worker decodes the rest
+                        const QSize size = QImageReader(cell.path).size();
+                        state->images[i] = {cell.path, QImage(),
+                                            size.isValid() ? std::min(size.width(), size.height()) : 0};
+                    } else {
+                        Source& source = sourceFor(state->job, cell);
+                        decode(source);
+                        state->images[i] = {cell.path, source.image, source.sourceSize};
+                    }
+                    if (--state->pending == 0) {
+                        submitRender();
+                    }
+                });
+            }
+        }
+        done.acquire(static_cast<int>(jobs.size()));
+    }
+
+private:
+    // One source file cropped to one tile shape, decoded on first use. The
+    // map is filled before any stage starts and only read afterwards.
+    struct Source {
+        QString path;
+        QMutex mutex;
+        bool decoded = false;
+        QSize maxSize;         // largest any collage of the batch needs
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+        int holders = 0;       // cells of the collages in flight
+        QImage image;
+        int sourceSize = 0;
+    };
+
+    struct JobState {
+        explicit JobState(const BatchJob& job) : job(job), images(job.cells.size()) {}
+        BatchJob job;
+        bool streamed = false;
+        int memoryUnits = 0;   // MB of the budget taken until the render is done
+        std::vector<CollageWorker::ImageData> images;  // parallel to job.cells
+        std::atomic<int> pending{0};
+        QByteArray encoded;
+    };
+
+    Settings settings;
+    QThreadPool decodePool;
+    QThreadPool renderPool;
+    QThreadPool writePool;
+    std::map<QString, std::unique_ptr<Source>> sources;
+
+    static QSize sourceBound(const BatchJob& job) {
+        return CollageWorker::sourceBound(job.rows, job.cols, job.maxSize, QSize(job.width, job.height));
+    }
+
+    static Resampler::Filter jobFilter(const BatchJob& job) {
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+        Resampler::filterFromName(job.filter, &filter);
+        return filter;
+    }
+
+    // Crops of the same aspect ratio are one source, decoded at the larger.
+    // The filter matters to files read in place, see decodeCenterCrop.
+    static QString sourceId(const QString& path, const QSize& bound, Resampler::Filter filter) {
+        const int divisor = std::gcd(bound.width(), bound.height());
+        return QString("%1|%2:%3|%4").arg(path).arg(bound.width() / divisor).arg(bound.height() / divisor)
+            .arg(MappedImage::mayMap(path) ? Resampler::filterName(filter) : "");
+    }
+
+    Source& sourceFor(const BatchJob& job, const BatchCell& cell) {
+        return *sources.at(sourceId(cell.path, sourceBound(job), jobFilter(job)));
+    }
+
+    // Decided on the largest layout the job can have, before any source is
+    // known: a smaller one only means the worker composes a canvas from
+    // sources it decodes itself
+    static bool isStreamed(const BatchJob& job) {
+        const QSize outputSize(job.width, job.height);
+        const QSize bound = sourceBound(job);
+        return CollageWorker::isStreamed(
+            CollageWorker::planLayout(job.rows, job.cols, job.maxSize, outputSize, std::max(bound.width(), bound.height())),
+            CollageWorker::formatForPath(job.outputPath));
+    }
+
+    // What a job holds while in flight: each of its sources in full even if
+    // another job shares it, or for a streamed one the sources its worker
+    // decodes at a time and one band
+    qint64 heldBytes(const JobState& state) const {
+        const BatchJob& job = state.job;
+        const QSize bound = sourceBound(job);
+        const qint64 sourceBytes = static_cast<qint64>(bound.width()) * bound.height() * 4;
+        if (state.streamed) {
+            const CollageWorker::Layout layout = CollageWorker::planLayout(
+                job.rows, job.cols, job.maxSize, QSize(job.width, job.height), std::max(bound.width(), bound.height()));
+            const qint64 decodedAtOnce = std::min<qint64>(static_cast<qint64>(job.cells.size()),
+                                                          std::max(1, QThread::idealThreadCount()));
+            return decodedAtOnce * sourceBytes + static_cast<qint64>(layout.width()) * layout.tile.height() * 4;
+        }
+        std::set<const Source*> distinct;
+        qint64 bytes = 0;
+        for (const BatchCell& cell : job.cells) {
+            const Source& source = *sources.at(sourceId(cell.path, bound, jobFilter(job)));
+            if (distinct.insert(&source).second) {
+                bytes += static_cast<qint64>(source.maxSize.width()) * source.maxSize.height() * 4;
+            }
+        }
+        return bytes;
+    }
+
+    void planSources(const std::vector<std::unique_ptr<JobState>>& states) {
+        for (const auto& state : states) {
+            if (state->streamed) {
+                continue;
+            }
+            const BatchJob& job = state->job;
+            const QSize bound = sourceBound(job);
+            const Resampler::Filter filter = jobFilter(job);
+            for (const BatchCell& cell : job.cells) {
+                std::unique_ptr<Source>& source = sources[sourceId(cell.path, bound, filter)];
+                if (!source) {
+                    source.reset(new Source);
+                    source->path = cell.path;
+                    source->filter = filter;
+                }
+                if (bound.width() > source->maxSize.width()) {
+                    source->maxSize = bound;
+                }
+            }
+        }
+    }
+
+    // The job's cells keep their sources until release(job)
+    void hold(const BatchJob& job) {
+        for (const BatchCell& cell : job.cells) {
+            Source& source = sourceFor(job, cell);
+            QMutexLocker locker(&source.mutex);
+            source.holders++;
+        }
+    }
+
+    // A second cell with the same source waits here for the first decode
+    void decode(Source& source) {
+        QMutexLocker locker(&source.mutex);
+        if (!source.decoded) {
+            source.image = CollageWorker::loadCenterCrop(source.path, source.maxSize, &source.sourceSize,
+                                                         settings.diskCache.get(), source.filter);
+            source.decoded = true;
+        }
+    }
+
+    // The last collage in flight using a source lets go of its pixels; a
+    // later one decodes it again, so no source outlives the budget it was
+    // counted in
+    void release(const BatchJob& job) {
+        for (const BatchCell& cell : job.cells) {
+            Source& source = sourceFor(job, cell);
+            QMutexLocker locker(&source.mutex);
+            if (--source.holders == 0) {
+                source.image = QImage();
+                source.decoded = false;
+            }
+        }
+    }
+
+    void render(JobState& state, QSemaphore& memory, QSemaphore& writeSlots, QSemaphore& done,
+                const Report& report) {
+        const BatchJob& job = state.job;
+        QString message;
+        bool ok = true;
+        ImageStore images(job.rows, job.cols);
+        for (size_t i = 0; i < job.cells.size(); i++) {
+            // Streamed cells are only placeholders, their worker reports
+            // a source it fails to decode
+            if (!state.streamed && state.images[i].image.isNull()) {
+                message = QString("Не удалось загрузить изображение %1").arg(job.cells[i].path);
+                ok = false;
+                break;
+            }
+            images.set(job.cells[i].row, job.cells[i].col, state.images[i]);
+        }
+        state.images.clear();
+        if (!state.streamed) {
+            release(job);
+        }
+
+        if (ok) {
+            CollageWorker::EncodeOptions options = CollageWorker::encodeOptions(
+                CollageWorker::presetFromName(job.preset), CollageWorker::formatForPath(job.outputPath));
+            CollageWorker worker(images, job.maxSize, job.outputPath, options);
+            worker.setOutputSize(QSize(job.width, job.height));
+            worker.setFilter(jobFilter(job));
+            worker.setDiskCache(settings.diskCache);
+            worker.setOutputBuffer(&state.encoded);
+            // No event loop here: the lambda is called directly from process()
+            QObject::connect(&worker, &CollageWorker::finished, [&](bool success, QString text) {
+                ok = success;
+                message = text;
+            });
+            worker.process();
+        }
+        images = ImageStore();
+        memory.release(state.memoryUnits); // the next collage may start decoding
+
+        if (!ok || state.encoded.isEmpty()) {
+            // Failed, or streamed to the file by the worker itself
+            report(job, ok, message);
+            done.release();
+            return;
+        }
+
+        writeSlots.acquire(); // backpressure from the write stage
+        QtConcurrent::run(&writePool, [&state, &writeSlots, &done, &report]() {
+            QSaveFile file(state.job.outputPath);
+            bool written = false;
+            {
+                StatsScope scope(Stats::Stage::Save, 0, state.encoded.size());
+                written = file.open(QIODevice::WriteOnly) && file.write(state.encoded) == state.encoded.size() &&
+                          file.commit();
+            }
+            state.encoded = QByteArray();
+            writeSlots.release();
+            report(state.job, written, written ? QString() : "Ошибка сохранения файла!");
+            done.release();
+        });
+    }
+};
@@ -0,0 +1,334 @@
+// collage_bench: times the collage pipeline on synthetic inputs.
+//
+// For every (source megapixels, grid size) scenario it generates JPEG
+// sources with mixed aspect ratios, then measures the stages the way the
+// app runs them - decode (center square, scaled decode), crop, resample,
+// paint and encode - and finally a full CollageWorker::process run. Reports
+// wall time, per-stage time, peak RSS and throughput in megapixels/second.
+// A second export with two cells swapped shows what RenderCache saves.
+// The resample stage is also run through Qt's smooth scaler, the path the
+// app used before Resampler, for a speed and PSNR comparison.
+
+#include <QBuffer>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QImageWriter>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QtConcurrent>
+#include <cmath>
+#include <vector>
+
+#include "benchsupport.h"
+#include "collageworker.h"
+
+namespace {
+
+struct Aspect {
+    int w;
+    int h;
+};
+
+// Cells cycle through these so every grid mixes landscape, portrait and square
+const Aspect aspects[] = {{4, 3}, {16, 9}, {1, 1}, {2, 3}};
+
+struct StageTimes {
+    double decode = 0;
+    double crop = 0;
+    double resample = 0;
+    double qtResample = 0;  // QImage::scaled on the same tiles
+    double psnr = 0;        // of our tiles against Qt's, dB
+    double paint = 0;
+    double encode = 0;
+    double total = 0;  // full CollageWorker::process run
+    double incremental = 0;  // the same after swapping two cells, with a warm RenderCache
+};
+
+QString writeSource(const QString& dir, double megapixels, const Aspect& aspect, quint32 seed) {
+    const double pixels = megapixels * 1e6;
+    int height = static_cast<int>(std::sqrt(pixels * aspect.h / aspect.w));
+    int width = static_cast<int>(pixels / height);
+    QString path = QDir(dir).filePath(QString("src_%1mp_%2x%3.jpg").arg(megapixels).arg(aspect.w).arg(aspect.h));
+    QImageWriter writer(path, "jpeg");
+    writer.setQuality(90);
+    if (!writer.write(syntheticImage(width, height, seed))) {
+        // No JPEG plugin: PNG still exercises the whole pipeline
+        path.replace(".jpg", ".png");
+        QImageWriter pngWriter(path, "png");
+        pngWriter.write(syntheticImage(width, height, seed));
+    }
+    return path;
+}
+
+std::vector<int> parseList(const QString& value) {
+    std::vector<int> list;
+    for (const QString& item : value.split(',')) {
+        if (!item.trimmed().isEmpty()) {
+            list.push_back(item.toInt());
+        }
+    }
+    return list;
+}
+
+}  // namespace
+
+class Bench {
+public:
+    Bench(int maxSize, const CollageWorker::EncodeOptions& options, Resampler::Filter filter,
+          const QString& workDir)
+        : maxSize(maxSize), options(options), filter(filter), workDir(workDir) {}
+
+    // Times one scenario; collageSize receives the side of the result
+    StageTimes run(const std::vector<QString>& sources, int gridSize, int* collageSize) {
+        StageTimes times;
+        const int cellCount = gridSize * gridSize;
+        const int maxSide = maxSize / gridSize;
+        QElapsedTimer timer;
+
+        // Decode: what the GUI and --batch do when a file lands in a cell
+        std::vector<CollageWorker::ImageData> decoded(static_cast<size_t>(cellCount));
+        timer.start();
+        QtConcurrent::blockingMap(decoded, [&](CollageWorker::ImageData& data) {
+            size_t cell = static_cast<size_t>(&data - decoded.data());
+            data.path = sources[cell % sources.size()];
+            data.image = CollageWorker::decodeCenterSquare(data.path, maxSide, &data.sourceSize);
+        });
+        times.decode = seconds(timer);
+
+        // The tile the worker will plan for these sources
+        int largestSource = 0;
+        for (const CollageWorker::ImageData& data : decoded) {
+            largestSource = std::max(largestSource, data.sourceSize);
+        }
+        const int tileSize = CollageWorker::planLayout(gridSize, gridSize, maxSize, QSize(), largestSource)
+                                 .tile.width();
+        *collageSize = tileSize * gridSize;
+
+        // Crop: the center-square view the worker takes of every tile
+        std::vector<QImage> views(decoded.size());
+        timer.restart();
+        for (size_t i = 0; i < decoded.size(); i++) {
+            views[i] = CollageWorker::centerSquareView(decoded[i].image);
+        }
+        times.crop = seconds(timer);
+
+        // Resample
+        std::vector<QImage> resized(views.size());
+        timer.restart();
+        QtConcurrent::blockingMap(resized, [&](QImage& tile) {
+            size_t i = static_cast<size_t>(&tile - resized.data());
+            tile = CollageWorker::resampleTile(views[i], QSize(tileSize, tileSize), filter);
+        });
+        times.resample = seconds(timer);
+
+        std::vector<QImage> reference(views.size());
+        timer.restart();
+        QtConcurrent::blockingMap(reference, [&](QImage& tile) {
+            size_t i = static_cast<size_t>(&tile - reference.data());
+            tile = views[i].scaled(tileSize, tileSize, Qt::IgnoreAspectRatio, Qt::SmoothTransformation)
+                       .convertToFormat(QImage::Format_RGB32);
+        });
+        times.qtResample = seconds(timer);
+        times.psnr = psnr(resized, reference);
+        reference.clear();
+
+        // Paint into the canvas, one writable view per cell
+        QImage canvas(*collageSize, *collageSize, QImage::Format_RGB32);
+        canvas.fill(Qt::white);
+        uchar* bits = canvas.bits();
+        const int stride = canvas.bytesPerLine();
+        timer.restart();
+        QtConcurrent::blockingMap(resized, [&](QImage& tile) {
+            int cell = static_cast<int>(&tile - resized.data());
+            uchar* origin = bits + static_cast<size_t>(cell / gridSize) * tileSize * stride
+                                 + static_cast<size_t>(cell % gridSize) * tileSize * 4;
+            QImage dest(origin, tileSize, tileSize, stride, QImage::Format_RGB32);
+            CollageWorker::paintTile(tile, dest);
+        });
+        times.paint = seconds(timer);
+        views.clear();
+        resized.clear();
+
+        // Encode to memory so disk speed stays out of the number
+        QBuffer buffer;
+        buffer.open(QIODevice::WriteOnly);
+        timer.restart();
+        CollageWorker::encodeImage(canvas, options, buffer);
+        times.encode = seconds(timer);
+        canvas = QImage();
+        buffer.close();
+        buffer.setData(QByteArray());
+
+        // The real thing, end to end from decoded sources to a file
+        ImageStore images(gridSize);
+        for (int cell = 0; cell < cellCount; cell++) {
+            images.set(cell / gridSize, cell % gridSize, decoded[static_cast<size_t>(cell)]);
+        }
+        decoded.clear();
+        times.total = runWorker(images, nullptr);
+
+        // Export again after swapping two cells, as when tweaking a layout:
+        // everything else comes from the render cache
+        auto cache = std::make_shared<RenderCache>(1LL << 30);
+        if (runWorker(images, cache) >= 0) {
+            if (gridSize > 1) {
+                ImageStore::Handle first = images.at(0, 0);
+                images.set(0, 0, images.at(0, 1));
+                images.set(0, 1, first);
+            }
+            times.incremental = runWorker(images, cache);
+        } else {
+            times.incremental = -1;
+        }
+
+        return times;
+    }
+
+    // Seconds for CollageWorker::process, -1 if it failed
+    double runWorker(const ImageStore& images, std::shared_ptr<RenderCache> cache) {
+        QString outputPath = QDir(workDir).filePath("collage." + QString::fromLatin1(options.format));
+        CollageWorker worker(images, maxSize, outputPath, options);
+        worker.setFilter(filter);
+        worker.setRenderCache(std::move(cache));
+        bool ok = false;
+        QObject::connect(&worker, &CollageWorker::finished, [&ok](bool success, QString) { ok = success; });
+        QElapsedTimer timer;
+        timer.start();
+        worker.process();
+        double elapsed = seconds(timer);
+        QFile::remove(outputPath);
+        return ok ? elapsed : -1;
+    }
+
+private:
+    int maxSize;
+    CollageWorker::EncodeOptions options;
+    Resampler::Filter filter;
+    QString workDir;
+};
+
+int main(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Замер этапов сборки коллажа на синтетических изображениях");
+    parser.addHelpOption();
+    QCommandLineOption megapixelsOption("megapixels", "Размеры исходников в мегапикселях.", "LIST", "2,12,24");
+    QCommandLineOption gridsOption("grids", "Размеры сетки.", "LIST", "1,2,3,5,10");
+    QCommandLineOption maxSizeOption("max-size", "Максимальная сторона коллажа, px.", "PX", "4000");
+    QCommandLineOption formatOption("format", "Формат результата: png или jpeg.", "NAME", "png");
+    QCommandLineOption presetOption("preset", "Сжатие: fast, balanced или smallest.", "NAME", "balanced");
+    QCommandLineOption filterOption("filter", "Фильтр: lanczos3, bicubic или box.", "NAME", "lanczos3");
+    QCommandLineOption repeatOption("repeat", "Повторов на сценарий, берется лучший.", "N", "3");
+    QCommandLineOption csvOption("csv", "Дополнительно записать результаты в CSV.", "FILE");
+    parser.addOptions({megapixelsOption, gridsOption, maxSizeOption, formatOption, presetOption,
+                       filterOption, repeatOption, csvOption});
+    parser.process(app);
+
+    QTemporaryDir workDir;
+    if (!workDir.isValid()) {
+        QTextStream(stderr) << "Не удалось создать временную папку\n";
+        return 1;
+    }
+
+    CollageWorker::EncodePreset preset = CollageWorker::presetFromName(parser.value(presetOption));
+    CollageWorker::EncodeOptions options = CollageWorker::encodeOptions(preset,
+                                                                        parser.value(formatOption).toLatin1());
+    const int maxSize = parser.value(maxSizeOption).toInt();
+    const int repeat = std::max(1, parser.value(repeatOption).toInt());
+    Resampler::Filter filter;
+    if (!Resampler::filterFromName(parser.value(filterOption), &filter)) {
+        QTextStream(stderr) << "Неизвестный фильтр " << parser.value(filterOption) << "\n";
+        return 1;
+    }
+    Bench bench(maxSize, options, filter, workDir.path());
+    QTextStream(stdout) << "resampler: " << Resampler::backendName() << "\n";
+
+    QTextStream out(stdout);
+    QFile csvFile(parser.value(csvOption));
+    QTextStream csv(&csvFile);
+    if (parser.isSet(csvOption)) {
+        if (!csvFile.open(QIODevice::WriteOnly | QIODevice::Text)) {
+            QTextStream(stderr) << "Не удалось открыть " << csvFile.fileName() << "\n";
+            return 1;
+        }
+        csv << "source_mp,grid,collage,decode_s,crop_s,resample_s,qt_resample_s,psnr_db,paint_s,encode_s,wall_s,"
+               "incremental_s,"
+               "peak_rss_mb,in_mps,out_mps\n";
+    }
+
+    out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10 %11 %12 %13 %14\n")
+           .arg("src MP", 6).arg("grid", 4).arg("collage", 7)
+           .arg("decode", 8).arg("crop", 8).arg("resample", 8).arg("qt", 8).arg("PSNR", 5)
+           .arg("paint", 8).arg("encode", 8).arg("wall", 8).arg("incr", 8).arg("RSS MB", 7).arg("out MP/s", 8);
+
+    int failures = 0;
+    quint32 seed = 1;
+    for (int megapixels : parseList(parser.value(megapixelsOption))) {
+        std::vector<QString> sources;
+        for (const Aspect& aspect : aspects) {
+            sources.push_back(writeSource(workDir.path(), megapixels, aspect, seed++));
+        }
+
+        for (int gridSize : parseList(parser.value(gridsOption))) {
+            if (gridSize < 1 || maxSize / gridSize < 1) {
+                continue;
+            }
+            // Best of N per stage: the least disturbed run of each
+            StageTimes best;
+            int collageSize = 0;
+            resetPeakRss();
+            for (int i = 0; i < repeat; i++) {
+                StageTimes times = bench.run(sources, gridSize, &collageSize);
+                if (times.total < 0 || times.incremental < 0) {
+                    failures++;
+                }
+                if (i == 0) {
+                    best = times;
+                    continue;
+                }
+                best.decode = std::min(best.decode, times.decode);
+                best.crop = std::min(best.crop, times.crop);
+                best.resample = std::min(best.resample, times.resample);
+                best.qtResample = std::min(best.qtResample, times.qtResample);
+                best.paint = std::min(best.paint, times.paint);
+                best.encode = std::min(best.encode, times.encode);
+                best.total = std::min(best.total, times.total);
+                best.incremental = std::min(best.incremental, times.incremental);
+            }
+            const double rssMb = peakRss() / (1024.0 * 1024.0);
+            const double inMegapixels = static_cast<double>(megapixels) * gridSize * gridSize;
+            const double outMegapixels = static_cast<double>(collageSize) * collageSize / 1e6;
+            const double outRate = best.total > 0 ? outMegapixels / best.total : 0;
+
+            out << QString("%1 %2 %3 %4 %5 %6 %7 %8 %9 %10 %11 %12 %13 %14\n")
+                   .arg(megapixels, 6).arg(gridSize, 4).arg(collageSize, 7)
+                   .arg(best.decode, 8, 'f', 4).arg(best.crop, 8, 'f', 4)
+                   .arg(best.resample, 8, 'f', 4).arg(best.qtResample, 8, 'f', 4)
+                   .arg(best.psnr, 5, 'f', 1).arg(best.paint, 8, 'f', 4)
+                   .arg(best.encode, 8, 'f', 4).arg(best.total, 8, 'f', 4)
+                   .arg(best.incremental, 8, 'f', 4)
+                   .arg(rssMb, 7, 'f', 1).arg(outRate, 8, 'f', 1);
+            out.flush();
+
+            if (csvFile.isOpen()) {
+                csv << megapixels << ',' << gridSize << ',' << collageSize << ','
+                    << best.decode << ',' << best.crop << ',' << best.resample << ','
+                    << best.qtResample << ',' << best.psnr << ','
+                    << best.paint << ',' << best.encode << ',' << best.total << ',' << best.incremental << ','
+                    << rssMb << ',' << (best.decode > 0 ? inMegapixels / best.decode : 0) << ','
+                    << outRate << '\n';
+            }
+        }
+    }
+
+    if (failures > 0) {
+        QTextStream(stderr) << failures << " прогонов CollageWorker завершились ошибкой\n";
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <cmath>
+#include <vector>
+
+#ifdef Q_OS_WIN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+// Synthetic inputs and measurements shared by collage_bench and the
+// regression suite
+
+inline double seconds(const QElapsedTimer& timer) {
+    return timer.nsecsElapsed() / 1e9;
+}
+
+// Peak resident set size of the process in bytes
+inline qint64 peakRss() {
+#if defined(Q_OS_WIN)
+    PROCESS_MEMORY_COUNTERS counters;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+        return static_cast<qint64>(counters.PeakWorkingSetSize);
+    }
+    return 0;
+#else
+#if defined(Q_OS_LINUX)
+    // VmHWM follows resetPeakRss, ru_maxrss doesn't
+    QFile status("/proc/self/status");
+    if (status.open(QIODevice::ReadOnly)) {
+        for (const QByteArray& line : status.readAll().split('\n')) {
+            if (line.startsWith("VmHWM:")) {
+                return line.mid(6).trimmed().split(' ').first().toLongLong() * 1024;
+            }
+        }
+    }
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#if defined(Q_OS_MACOS)
+    return usage.ru_maxrss;
+#else
+    return static_cast<qint64>(usage.ru_maxrss) * 1024;
+#endif
+#endif
+}
+
+// Lets each scenario report its own peak instead of the largest so far.
+// Only Linux can do this; elsewhere the peak is cumulative.
+inline void resetPeakRss() {
+#if defined(Q_OS_LINUX)
+    QFile clearRefs("/proc/self/clear_refs");
+    if (clearRefs.open(QIODevice::WriteOnly)) {
+        clearRefs.write("5");
+    }
+#endif
+}
+
+// Smooth gradients plus fine high-contrast detail, so neither the decoder
+// nor the resampler gets an unrealistically easy image
+inline QImage syntheticImage(int width, int height, quint32 seed) {
+    QImage image(width, height, QImage::Format_RGB32);
+    quint32 state = seed * 2654435761u + 1;
+    for (int y = 0; y < height; y++) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < width; x++) {
+            state = state * 1664525u + 1013904223u;
+            int noise = static_cast<int>(state >> 28);
+            int r = (x * 255 / width + noise) & 0xff;
+            int g = (y * 255 / height + noise) & 0xff;
+            int b = ((x ^ y) & 0x20) ? 200 + noise : 40 + noise;
+            line[x] = qRgb(r, g, b);
+        }
+    }
+    return image;
+}
+
+// Over the RGB channels of equally sized RGB32 images
+inline double psnr(const std::vector<QImage>& a, const std::vector<QImage>& b) {
+    double squaredError = 0;
+    double samples = 0;
+    for (size_t i = 0; i < a.size(); i++) {
+        for (int y = 0; y < a[i].height(); y++) {
+            const QRgb* lineA = reinterpret_cast<const QRgb*>(a[i].constScanLine(y));
+            const QRgb* lineB = reinterpret_cast<const QRgb*>(b[i].constScanLine(y));
+            for (int x = 0; x < a[i].width(); x++) {
+                int dr = qRed(lineA[x]) - qRed(lineB[x]);
+                int dg = qGreen(lineA[x]) - qGreen(lineB[x]);
+                int db = qBlue(lineA[x]) - qBlue(lineB[x]);
+                squaredError += dr * dr + dg * dg + db * db;
+            }
+        }
+        samples += 3.0 * a[i].width() * a[i].height();
+    }
+    if (squaredError == 0) {
+        return 99.0;
+    }
+    return 10.0 * std::log10(255.0 * 255.0 * samples / squaredError);
+}
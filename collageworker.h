@@ -0,0 +1,965 @@
+#pragma once
+
+#include <QObject>
+#include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QSaveFile>
+#include <QFileInfo>
+#include <QPainter>
+#include <QtConcurrent>
+#include <QAtomicInt>
+#include <QBuffer>
+#include <QMutex>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+
+#include "diskcache.h"
+#include "glcompositor.h"
+#include "imagestore.h"
+#include "mappedimage.h"
+#include "pixelpool.h"
+#include "pngwriter.h"
+#include "rendercache.h"
+#include "resampler.h"
+#include "stats.h"
+
+// Worker class for collage creation in separate thread
+class CollageWorker : public QObject {
+    Q_OBJECT
+public:
+    using ImageData = SourceImage;
+
+    // Set from any thread to abandon the job; process() polls it between
+    // tiles and while the encoder writes
+    using CancelToken = std::shared_ptr<std::atomic<bool>>;
+
+    // Speed / file size trade-off of the encoder
+    enum class EncodePreset { Fast, Balanced, Smallest };
+
+    struct EncodeOptions {
+        QByteArray format;  // QImageWriter format name
+        int pngLevel;       // zlib level, 0-9
+        int jpegQuality;
+        bool optimize;      // extra encoder passes for a smaller file
+
+        EncodeOptions() : format("png"), pngLevel(6), jpegQuality(90), optimize(false) {}
+    };
+
+    static EncodeOptions encodeOptions(EncodePreset preset, const QByteArray& format) {
+        EncodeOptions options;
+        options.format = format;
+        switch (preset) {
+        case EncodePreset::Fast:
+            // JPEG quality barely changes encode speed, so only PNG gets
+            // faster here; JPEG stays at the Balanced quality
+            options.pngLevel = 1;
+            break;
+        case EncodePreset::Balanced:
+            break;
+        case EncodePreset::Smallest:
+            options.pngLevel = 9;
+            options.jpegQuality = 80;
+            options.optimize = true;
+            break;
+        }
+        return options;
+    }
+
+    // Output format from the file extension, then from the dialog filter,
+    // PNG if neither names a format Qt can write
+    static QByteArray formatForPath(const QString& path, const QString& filter = QString()) {
+        QByteArray suffix = QFileInfo(path).suffix().toLower().toLatin1();
+        if (suffix == "jpg" || suffix == "jpeg") {
+            return "jpeg";
+        }
+        if (!suffix.isEmpty() && QImageWriter::supportedImageFormats().contains(suffix)) {
+            return suffix;
+        }
+        if (filter.startsWith("JPEG")) {
+            return "jpeg";
+        }
+        return "png";
+    }
+
+    // Geometry of a collage, fixed before the first tile is made: rows x
+    // cols tiles of one size, square unless an output size says otherwise
+    struct Layout {
+        int rows = 0;
+        int cols = 0;
+        QSize tile;
+
+        int width() const { return cols * tile.width(); }
+        int height() const { return rows * tile.height(); }
+    };
+
+    // With an output size the tiles divide it evenly (what is left over is
+    // less than a pixel per row or column and is cut) and every source is
+    // scaled to fill its tile. Without one the tiles are squares as large as
+    // the largest source and maxSize allow: smaller photos are upscaled
+    // instead of shrinking every other tile to their size.
+    static Layout planLayout(int rows, int cols, int maxSize, const QSize& outputSize, int largestSource) {
+        Layout layout{rows, cols, QSize()};
+        if (!outputSize.isEmpty()) {
+            layout.tile = QSize(std::max(1, outputSize.width() / std::max(cols, 1)),
+                                std::max(1, outputSize.height() / std::max(rows, 1)));
+        } else {
+            const int side = std::min(maxSize / std::max(1, std::max(rows, cols)), largestSource);
+            layout.tile = QSize(std::max(side, 1), std::max(side, 1));
+        }
+        return layout;
+    }
+
+    // The most a source is decoded at for such a collage, known before its
+    // sources are: the tile itself with an output size, else the largest
+    // square tile maxSize allows. A source decoded at this is resampled at
+    // most once more, into its tile.
+    static QSize sourceBound(int rows, int cols, int maxSize, const QSize& outputSize) {
+        if (!outputSize.isEmpty()) {
+            return planLayout(rows, cols, maxSize, outputSize, 0).tile;
+        }
+        const int side = std::max(1, maxSize / std::max(1, std::max(rows, cols)));
+        return QSize(side, side);
+    }
+
+    // images is taken as a snapshot: later changes to the caller's store
+    // don't reach the worker, and no pixels are copied. The grid is the
+    // store's rows x cols. Entries with a path but no image are decoded only
+    // if their tile is not cached; their sourceSize must be known unless
+    // they are to be decoded right away.
+    CollageWorker(const ImageStore& images,
+                  int maxSize, const QString& outputPath,
+                  const EncodeOptions& encodeOptions = EncodeOptions(),
+                  CancelToken cancelToken = CancelToken())
+        : images(images), maxCollageSize(maxSize), outputPath(outputPath),
+          options(encodeOptions), cancelToken(std::move(cancelToken)) {}
+
+    // Tiles of output / grid instead of squares planned from the sources
+    // and maxSize; an empty size goes back to that. Sources then need no
+    // sourceSize, nothing is decoded before its tile is made.
+    void setOutputSize(const QSize& size) {
+        outputSize = size;
+    }
+
+    // Whether such a collage is written band by band instead of being held
+    // in memory as a whole; only PNG can be
+    static bool isStreamed(const Layout& layout, const QByteArray& format) {
+        return std::max(layout.width(), layout.height()) > maxCanvasSize && format == "png";
+    }
+
+    // Resampling filter for the tiles, Lanczos3 unless set before process()
+    void setFilter(Resampler::Filter tileFilter) {
+        filter = tileFilter;
+    }
+
+    // Reuse tiles, the collage and PNG bands of earlier exports from cache,
+    // and leave this export's there for the next one
+    void setRenderCache(std::shared_ptr<RenderCache> cache) {
+        renderCache = std::move(cache);
+    }
+
+    // Tiles missing from the render cache are looked up on disk, and new
+    // ones are written there for later sessions
+    void setDiskCache(std::shared_ptr<DiskCache> cache) {
+        diskCache = std::move(cache);
+    }
+
+    // Encode into buffer instead of saving to outputPath, for callers that
+    // write the file on a thread of their own. Collages too large to hold
+    // in memory are still streamed to outputPath and leave buffer empty.
+    void setOutputBuffer(QByteArray* buffer) {
+        outputBuffer = buffer;
+    }
+
+    static EncodePreset presetFromName(const QString& name) {
+        if (name == "fast") return EncodePreset::Fast;
+        if (name == "smallest") return EncodePreset::Smallest;
+        return EncodePreset::Balanced;
+    }
+
+    static QString presetName(EncodePreset preset) {
+        switch (preset) {
+        case EncodePreset::Fast: return "fast";
+        case EncodePreset::Smallest: return "smallest";
+        case EncodePreset::Balanced: break;
+        }
+        return "balanced";
+    }
+
+    // Compose the tiles on the GPU when it can, on the CPU otherwise
+    void setCompositor(std::shared_ptr<GlCompositor> glCompositor) {
+        compositor = std::move(glCompositor);
+    }
+
+    // Decodes only the centered crop of the file with the aspect ratio of
+    // maxSize, reduced to at most maxSize. For JPEG the reader does this with
+    // a scaled IDCT, so the full resolution image is never materialized.
+    // sourceSide is set to the side of the file's center square. filter is
+    // the export's: when the bound is the tile, the reduction of a mapped
+    // file is the tile's only resample.
+    static QImage decodeCenterCrop(const QString& path, const QSize& maxSize, int* sourceSide = nullptr,
+                                   Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        StatsScope scope(Stats::Stage::Decode);
+        const QSize bound = maxSize.expandedTo(QSize(1, 1));
+        auto fits = [&bound](const QSize& size) {
+            return size.width() <= bound.width() && size.height() <= bound.height();
+        };
+
+        // Uncompressed BMP and TIFF are read in place, only the crop's pages
+        int mappedSide = 0;
+        QImage mapped = MappedImage::loadCenterCrop(path, bound, &mappedSide, filter);
+        if (!mapped.isNull()) {
+            if (sourceSide) *sourceSide = mappedSide;
+            scope.setPixels(static_cast<qint64>(mapped.width()) * mapped.height());
+            return mapped;
+        }
+
+        QImageReader reader(path);
+        QSize fullSize = reader.size();
+
+        if (!fullSize.isValid()) {
+            // The handler can't tell the size up front: decode everything
+            QImage full = reader.read();
+            if (full.isNull()) {
+                return QImage();
+            }
+            if (sourceSide) *sourceSide = std::min(full.width(), full.height());
+            scope.setPixels(static_cast<qint64>(full.width()) * full.height());
+            const QRect crop = Resampler::centerRect(full.size(), bound);
+            if (!fits(crop.size())) {
+                return toCanvasFormat(full.copy(crop).scaled(bound, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+            }
+            return toCanvasFormat(crop == full.rect() ? full : full.copy(crop));
+        }
+
+        const QRect crop = Resampler::centerRect(fullSize, bound);
+        const QSize outSize = fits(crop.size()) ? crop.size() : bound;
+        reader.setClipRect(crop);
+        if (outSize != crop.size()) {
+            reader.setScaledSize(outSize);
+        }
+
+        // Handlers that decode into a given image of the right size and
+        // format (JPEG does) fill the pooled one in place
+        QImage image = PixelPool::instance().image(outSize.width(), outSize.height(), reader.imageFormat());
+        if (!reader.read(&image)) {
+            image = QImage();
+        }
+        if (!image.isNull() && sourceSide) {
+            *sourceSide = std::min(fullSize.width(), fullSize.height());
+        }
+        scope.setPixels(static_cast<qint64>(image.width()) * image.height());
+        return toCanvasFormat(image);
+    }
+
+    // Sources are kept in the two formats the resampler reads in place, so
+    // the RGB888, Indexed8, gray or straight-alpha images some decoders
+    // produce are converted once here rather than on every resample
+    static QImage toCanvasFormat(const QImage& image) {
+        if (image.isNull() || image.format() == QImage::Format_RGB32 ||
+            image.format() == QImage::Format_ARGB32_Premultiplied) {
+            return image;
+        }
+        return image.convertToFormat(image.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied
+                                                             : QImage::Format_RGB32);
+    }
+
+    // The centered square of the file, reduced to at most maxSide pixels
+    static QImage decodeCenterSquare(const QString& path, int maxSide, int* sourceSide = nullptr,
+                                     Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        return decodeCenterCrop(path, QSize(maxSide, maxSide), sourceSide, filter);
+    }
+
+    // DiskCache key of the center crop of path decoded at maxSize. The
+    // filter only changes the crops of files read in place.
+    static QString cropKey(const QString& path, const QSize& maxSize,
+                           Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        QString what = maxSize.width() == maxSize.height()
+            ? QString("square|%1").arg(maxSize.width())
+            : QString("crop|%1x%2").arg(maxSize.width()).arg(maxSize.height());
+        if (MappedImage::mayMap(path)) {
+            what += QString("|%1").arg(Resampler::filterName(filter));
+        }
+        return DiskCache::sourceKey(path, what);
+    }
+
+    static QString squareKey(const QString& path, int maxSide, Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        return cropKey(path, QSize(maxSide, maxSide), filter);
+    }
+
+    // decodeCenterCrop through the disk cache: a crop decoded at this size
+    // in an earlier session is mapped from disk instead
+    static QImage loadCenterCrop(const QString& path, const QSize& maxSize, int* sourceSide, DiskCache* cache,
+                                 Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        if (!cache) {
+            return decodeCenterCrop(path, maxSize, sourceSide, filter);
+        }
+        const QString key = cropKey(path, maxSize, filter);
+        int side = 0;
+        QImage image = cache->load(key, &side);
+        if (!image.isNull()) {
+            Stats::instance().count(Stats::Counter::DiskHit);
+        } else {
+            Stats::instance().count(Stats::Counter::DiskMiss);
+            image = decodeCenterCrop(path, maxSize, &side, filter);
+            cache->store(key, image, side);
+        }
+        if (sourceSide && !image.isNull()) {
+            *sourceSide = side;
+        }
+        return image;
+    }
+
+    static QImage loadCenterSquare(const QString& path, int maxSide, int* sourceSide, DiskCache* cache,
+                                   Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        return loadCenterCrop(path, QSize(maxSide, maxSide), sourceSide, cache, filter);
+    }
+
+    // Crop + resample one tile straight into its rect of the canvas; dest is
+    // a writable view over that rect, and the crop is the center of source
+    // with dest's shape. Runs concurrently for different tiles.
+    static void renderTile(const QImage& source, QImage& dest, Resampler::Filter filter) {
+        StatsScope scope(Stats::Stage::Resample, static_cast<qint64>(dest.width()) * dest.height());
+        Resampler::resample(source, Resampler::centerRect(source.size(), dest.size()), dest, filter);
+    }
+
+    // Resample stage on its own: the center crop of source as a separate
+    // image of tileSize
+    static QImage resampleTile(const QImage& source, const QSize& tileSize, Resampler::Filter filter) {
+        QImage tile = PixelPool::instance().image(tileSize.width(), tileSize.height(), QImage::Format_RGB32);
+        renderTile(source, tile, filter);
+        return tile;
+    }
+
+    // Paint stage on its own: copies a tile made by resampleTile into dest,
+    // a view of the same size. renderTile doesn't need it, it resamples
+    // straight into the canvas.
+    static void paintTile(const QImage& tile, QImage& dest) {
+        StatsScope scope(Stats::Stage::Paint, static_cast<qint64>(dest.width()) * dest.height());
+        const size_t rowBytes = static_cast<size_t>(dest.width()) * 4;
+        for (int y = 0; y < dest.height(); y++) {
+            memcpy(dest.scanLine(y), tile.constScanLine(y), rowBytes);
+        }
+    }
+
+    static QRect centerSquareRect(const QSize& size) {
+        int side = std::min(size.width(), size.height());
+        return QRect((size.width() - side) / 2, (size.height() - side) / 2, side, side);
+    }
+
+    // The centered square of img as a non-owning view over img's pixels: no
+    // allocation and no copy, for code that wants the square as a QImage (the
+    // resampler takes the rect directly). The view must not outlive img.
+    static QImage centerSquareView(const QImage& img) {
+        if (img.width() == img.height()) {
+            return img;
+        }
+        const QRect square = centerSquareRect(img.size());
+        int newSize = square.width();
+        int left = square.left();
+        int top = square.top();
+
+        // Palettes, sub-byte pixels and unaligned rows can't be wrapped
+        const uchar* origin = img.constScanLine(top) + static_cast<size_t>(left) * (img.depth() / 8);
+        if (img.depth() < 8 || img.format() == QImage::Format_Indexed8 ||
+            reinterpret_cast<quintptr>(origin) % 4 != 0 || img.bytesPerLine() % 4 != 0) {
+            return img.copy(left, top, newSize, newSize);
+        }
+        return QImage(origin, newSize, newSize, img.bytesPerLine(), img.format());
+    }
+
+    // Encodes a whole in-memory collage with the given options
+    static bool encodeImage(const QImage& image, const EncodeOptions& options, QIODevice& device) {
+        StatsScope scope(Stats::Stage::Encode, static_cast<qint64>(image.width()) * image.height());
+        const qint64 start = device.pos();
+        auto write = [&]() {
+            if (options.format == "png") {
+#ifdef COLLAGE_HAVE_ZLIB
+                // Our writer deflates row chunks on all cores
+                PngWriter writer(&device, options.pngLevel);
+                return writer.begin(image.width(), image.height()) && writer.writeRows(image) && writer.finish();
+#else
+                // Qt maps PNG quality q to zlib level (100 - q) * 9 / 91
+                QImageWriter writer(&device, "png");
+                writer.setQuality(100 - (options.pngLevel * 91 + 8) / 9);
+                return writer.write(image);
+#endif
+            }
+
+            QImageWriter writer(&device, options.format);
+            writer.setQuality(options.jpegQuality);
+            writer.setOptimizedWrite(options.optimize);
+            return writer.write(image);
+        };
+        bool written = write();
+        scope.setBytes(device.pos() - start);
+        return written;
+    }
+
+signals:
+    void finished(bool success, QString message);
+    void progress(int value);
+    // After every placed tile: tiles so far, their pixels and the bytes
+    // written to the file
+    void tileProgress(int tiles, int tilesTotal, qint64 pixels, qint64 bytes);
+
+public slots:
+    void process() {
+        try {
+            std::vector<Tile> tiles;
+            int largestSource = 0;
+            for (int i = 0; i < images.rows(); i++) {
+                for (int j = 0; j < images.cols(); j++) {
+                    const ImageStore::Handle& data = images.at(i, j);
+                    if (!data || (data->image.isNull() && data->path.isEmpty())) {
+                        continue;
+                    }
+                    Tile tile{i, j, data->image, data->path, QString()};
+                    int sourceSize = data->sourceSize;
+                    if (tile.image.isNull() && sourceSize <= 0 && outputSize.isEmpty()) {
+                        // No size to plan with, decode it now
+                        tile.image = loadCenterCrop(tile.path, sourceBound(), &sourceSize, diskCache.get(), filter);
+                        if (tile.image.isNull()) {
+                            emit finished(false, QString("Не удалось загрузить изображение %1").arg(tile.path));
+                            return;
+                        }
+                    }
+                    if (sourceSize <= 0) {
+                        sourceSize = std::min(tile.image.width(), tile.image.height());
+                    }
+                    tiles.push_back(tile);
+                    largestSource = std::max(largestSource, sourceSize);
+                }
+            }
+
+            if (tiles.empty()) {
+                emit finished(false, "Нет изображений для создания коллажа!");
+                return;
+            }
+
+            emit progress(20);
+
+            if (isCancelled()) {
+                emit finished(false, "Отменено");
+                return;
+            }
+
+            // Every tile's size is settled here, once, before any pixel
+            // is resampled
+            layout = planLayout(images.rows(), images.cols(), maxCollageSize, outputSize, largestSource);
+            tilesTotal = static_cast<int>(tiles.size());
+            tilesDone.storeRelease(0);
+            pixelsDone = 0;
+            bytesWritten = 0;
+            if (renderCache) {
+                // GPU tiles come out slightly different, they must not mix
+                // with the CPU ones in the cached collage. The suffix is what
+                // the tile is expected to be; the CPU fallback of
+                // composeTiles drops it again.
+                const bool gpu = compositor && compositor->isAvailable();
+                for (Tile& tile : tiles) {
+                    tile.key = RenderCache::tileKey(tile.path, layout.tile, filter);
+                    if (gpu) {
+                        tile.key += QLatin1String(gpuKeySuffix);
+                    }
+                }
+            }
+            nextCanvas = RenderCache::Canvas();
+            nextBands.clear();
+            failedSource.clear();
+
+            const bool streamed = isStreamed(layout, options.format);
+            if (outputBuffer && !streamed) {
+                outputBuffer->clear();
+                QBuffer buffer(outputBuffer);
+                bool encoded = buffer.open(QIODevice::WriteOnly) &&
+                               writeCanvas(tiles, buffer);
+                bytesWritten = outputBuffer->size();
+                if (isCancelled() || !failedSource.isEmpty() || !encoded) {
+                    outputBuffer->clear();
+                    emit finished(false, isCancelled() ? QString("Отменено")
+                                  : !failedSource.isEmpty() ? QString("Не удалось загрузить изображение %1").arg(failedSource)
+                                  : QString("Ошибка кодирования коллажа!"));
+                    return;
+                }
+                if (renderCache) {
+                    renderCache->setCanvas(nextCanvas);
+                    renderCache->setBands(std::move(nextBands));
+                }
+                nextCanvas = RenderCache::Canvas();
+                nextBands.clear();
+                emit progress(100);
+                emit finished(true, QString("Коллаж %1x%2 закодирован").arg(layout.width()).arg(layout.height()));
+                return;
+            }
+
+            // QSaveFile writes to a temporary file, so a cancelled or failed
+            // job never leaves a partial collage at outputPath
+            CancellableSaveFile file(outputPath, cancelToken, &bytesWritten);
+            bool saved = false;
+            if (file.open(QIODevice::WriteOnly)) {
+                saved = streamed
+                    ? writeBands(tiles, file)
+                    : writeCanvas(tiles, file);
+            }
+
+            if (isCancelled()) {
+                file.cancelWriting();
+                emit finished(false, "Отменено");
+                return;
+            }
+            if (!failedSource.isEmpty()) {
+                file.cancelWriting();
+                emit finished(false, QString("Не удалось загрузить изображение %1").arg(failedSource));
+                return;
+            }
+            if (saved) {
+                StatsScope scope(Stats::Stage::Save, 0, bytesWritten.load());
+                saved = file.commit();
+            }
+            if (saved && renderCache) {
+                renderCache->setCanvas(nextCanvas);
+                renderCache->setBands(std::move(nextBands));
+            }
+            nextCanvas = RenderCache::Canvas();
+            nextBands.clear();
+
+            emit progress(100);
+
+            if (saved) {
+                emit finished(true, QString("Коллаж %1x%2 сохранен как:\n%3")
+                             .arg(layout.width()).arg(layout.height()).arg(outputPath));
+            } else {
+                emit finished(false, "Ошибка сохранения файла!");
+            }
+
+        } catch (const std::exception& e) {
+            emit finished(false, QString("Ошибка: %1").arg(e.what()));
+        }
+    }
+
+private:
+    struct Tile {
+        int row;
+        int col;
+        QImage image;
+        QString path;
+        QString key;  // RenderCache::tileKey, empty without a cache
+    };
+
+    // Fails every write once the job is cancelled, which makes the image
+    // writer abort instead of finishing the encode
+    class CancellableSaveFile : public QSaveFile {
+    public:
+        CancellableSaveFile(const QString& name, const CancelToken& token, std::atomic<qint64>* written)
+            : QSaveFile(name), token(token), written(written) {}
+
+    protected:
+        qint64 writeData(const char* data, qint64 len) override {
+            if (token && token->load()) {
+                return -1;
+            }
+            qint64 result = QSaveFile::writeData(data, len);
+            if (result > 0) {
+                written->fetch_add(result, std::memory_order_relaxed);
+            }
+            return result;
+        }
+
+    private:
+        CancelToken token;
+        std::atomic<qint64>* written;
+    };
+
+    ImageStore images;
+    int maxCollageSize;
+    QSize outputSize;
+    Layout layout;  // planned by process()
+    QString outputPath;
+    EncodeOptions options;
+    CancelToken cancelToken;
+    Resampler::Filter filter = Resampler::Filter::Lanczos3;
+    std::shared_ptr<RenderCache> renderCache;
+    std::shared_ptr<GlCompositor> compositor;
+    std::shared_ptr<DiskCache> diskCache;
+    QByteArray* outputBuffer = nullptr;
+    // Handed to renderCache once the file is committed
+    RenderCache::Canvas nextCanvas;
+    RenderCache::Bands nextBands;
+
+    bool isCancelled() const {
+        return cancelToken && cancelToken->load();
+    }
+
+    // A source that could not be decoded at export time, the job fails
+    QMutex failureMutex;
+    QString failedSource;
+
+    bool sourceFailed() {
+        QMutexLocker locker(&failureMutex);
+        return !failedSource.isEmpty();
+    }
+
+    QSize sourceBound() const {
+        return sourceBound(images.rows(), images.cols(), maxCollageSize, outputSize);
+    }
+
+    // Whether image has the tiles' shape, give or take the rounding of a
+    // crop decoded for them
+    bool fitsTile(const QSize& image) const {
+        const qint64 skew = static_cast<qint64>(image.width()) * layout.tile.height() -
+                            static_cast<qint64>(image.height()) * layout.tile.width();
+        return std::abs(skew) <= std::max(layout.tile.width(), layout.tile.height());
+    }
+
+    // Left undecoded by the caller, or decoded as a crop of another shape
+    // (the GUI holds squares)
+    bool needsDecode(const Tile& tile) const {
+        return tile.image.isNull() || (!tile.path.isEmpty() && !fitsTile(tile.image.size()));
+    }
+
+    // Decodes the source if needsDecode; false if that fails
+    bool ensureSource(Tile& tile) {
+        if (!needsDecode(tile)) {
+            return true;
+        }
+        tile.image = loadCenterCrop(tile.path, sourceBound(), nullptr, diskCache.get(), filter);
+        if (tile.image.isNull()) {
+            QMutexLocker locker(&failureMutex);
+            if (failedSource.isEmpty()) {
+                failedSource = tile.path;
+            }
+            return false;
+        }
+        return true;
+    }
+
+    // Marks the tile keys of GPU composed tiles
+    static constexpr char gpuKeySuffix[] = "|gl";
+
+    // Larger collages are never held in memory as a whole, see writeBands
+    static constexpr int maxCanvasSize = 8192;
+
+    QAtomicInt tilesDone;
+    int tilesTotal = 0;
+    std::atomic<qint64> pixelsDone{0};
+    std::atomic<qint64> bytesWritten{0};
+
+    // Progress for count more tiles
+    void tilesPlaced(int count) {
+        const qint64 placed = static_cast<qint64>(count) * layout.tile.width() * layout.tile.height();
+        int completed = tilesDone.fetchAndAddRelaxed(count) + count;
+        qint64 pixels = pixelsDone.fetch_add(placed) + placed;
+        emit progress(20 + (completed * 75) / tilesTotal);
+        emit tileProgress(completed, tilesTotal, pixels, bytesWritten.load(std::memory_order_relaxed));
+    }
+
+    // Builds the whole collage in memory and encodes it in one go. With a
+    // cache it starts from the last collage of the same layout and recomposes
+    // only the cells whose tile key changed.
+    bool writeCanvas(std::vector<Tile>& tiles, QIODevice& device) {
+        std::vector<QString> cells = cellKeys(tiles);
+        RenderCache::Canvas previous;
+        if (renderCache) {
+            previous = renderCache->canvas();
+        }
+
+        QImage collage;
+        auto dirty = tiles.begin();
+        if (!previous.image.isNull() && previous.rows == layout.rows && previous.cols == layout.cols &&
+            previous.tileSize == layout.tile) {
+            collage = previous.image; // detaches on the first write
+            for (size_t cell = 0; cell < cells.size(); cell++) {
+                if (cells[cell].isEmpty() && !previous.cells[cell].isEmpty()) {
+                    fillCell(collage, static_cast<int>(cell) / layout.cols, static_cast<int>(cell) % layout.cols);
+                }
+            }
+            // Clean tiles to the front, they are already in place
+            dirty = std::stable_partition(tiles.begin(), tiles.end(), [&](const Tile& tile) {
+                return tile.key == previous.cells[cellIndex(tile)];
+            });
+            for (auto it = tiles.begin(); it != dirty; ++it) {
+                it->image = QImage();
+            }
+            tilesTotal = static_cast<int>(tiles.end() - dirty);
+        } else {
+            collage = PixelPool::instance().image(layout.width(), layout.height(), QImage::Format_RGB32);
+            fillEmptyCells(collage, tiles.begin(), tiles.end(), 0, layout.rows);
+        }
+        previous = RenderCache::Canvas();
+
+        composeTiles(dirty, tiles.end(), collage, 0);
+        if (isCancelled() || sourceFailed()) {
+            return false;
+        }
+        updateCellKeys(cells, dirty, tiles.end());
+
+        emit progress(95);
+
+        if (renderCache) {
+            nextCanvas = {collage, cells, layout.rows, layout.cols, layout.tile};
+#ifdef COLLAGE_HAVE_ZLIB
+            // Grid rows as independent bands: unchanged rows are not deflated again
+            if (options.format == "png") {
+                PngWriter writer(&device, options.pngLevel);
+                if (!writer.begin(layout.width(), layout.height())) {
+                    return false;
+                }
+                const int bandHeight = layout.tile.height();
+                for (int row = 0; row < layout.rows; row++) {
+                    const QString key = bandKey(cells, row, writer);
+                    PngWriter::EncodedBand encoded = renderCache->band(key);
+                    if (encoded.rows <= 0) {
+                        QImage band(collage.constScanLine(row * bandHeight), layout.width(), bandHeight,
+                                    collage.bytesPerLine(), QImage::Format_RGB32);
+                        StatsScope scope(Stats::Stage::Encode, static_cast<qint64>(layout.width()) * bandHeight);
+                        encoded = writer.encodeBand(band);
+                        scope.setBytes(encoded.data.size());
+                    }
+                    if (!writer.writeBand(encoded)) {
+                        return false;
+                    }
+                    nextBands[key] = encoded;
+                }
+                return writer.finish();
+            }
+#endif
+        }
+
+        return encodeImage(collage, options, device);
+    }
+
+    // Composes one grid row at a time into a band of layout.cols tiles and
+    // streams it to the PNG encoder, so peak memory is one band instead of
+    // the whole collage. With a cache, rows whose cells are unchanged since
+    // the last export are copied as encoded bands without composing them.
+    bool writeBands(std::vector<Tile>& tiles, QIODevice& device) {
+        PngWriter writer(&device, options.pngLevel);
+        if (!writer.begin(layout.width(), layout.height())) {
+            return false;
+        }
+
+        std::vector<QString> cells = renderCache ? cellKeys(tiles) : std::vector<QString>();
+        QImage band = PixelPool::instance().image(layout.width(), layout.tile.height(), QImage::Format_RGB32);
+        auto first = tiles.begin();
+        for (int row = 0; row < layout.rows; row++) {
+            if (isCancelled() || sourceFailed()) {
+                return false;
+            }
+            // tiles are in row-major order
+            auto last = std::find_if(first, tiles.end(), [row](const Tile& tile) { return tile.row != row; });
+
+            QString key;
+            PngWriter::EncodedBand encoded;
+            if (renderCache) {
+                key = bandKey(cells, row, writer);
+                encoded = renderCache->band(key);
+            }
+            if (encoded.rows > 0) {
+                for (auto it = first; it != last; ++it) {
+                    it->image = QImage();
+                }
+                tilesPlaced(static_cast<int>(last - first));
+            } else {
+                fillEmptyCells(band, first, last, row, 1);
+                composeTiles(first, last, band, row);
+                if (sourceFailed()) {
+                    return false;
+                }
+                StatsScope scope(Stats::Stage::Encode, static_cast<qint64>(band.width()) * band.height());
+                if (renderCache) {
+                    updateCellKeys(cells, first, last);
+                    key = bandKey(cells, row, writer);
+                    encoded = writer.encodeBand(band);
+                    scope.setBytes(encoded.data.size());
+                } else {
+                    const qint64 before = bytesWritten.load(std::memory_order_relaxed);
+                    if (!writer.writeRows(band)) {
+                        return false;
+                    }
+                    scope.setBytes(bytesWritten.load(std::memory_order_relaxed) - before);
+                }
+            }
+            if (renderCache) {
+                if (!writer.writeBand(encoded)) {
+                    return false;
+                }
+                nextBands[key] = encoded;
+            }
+            first = last;
+        }
+
+        emit progress(95);
+        return writer.finish();
+    }
+
+    size_t cellIndex(const Tile& tile) const {
+        return static_cast<size_t>(tile.row) * layout.cols + tile.col;
+    }
+
+    // Tile key per cell in row-major order, empty for blank cells
+    std::vector<QString> cellKeys(const std::vector<Tile>& tiles) const {
+        std::vector<QString> cells(static_cast<size_t>(layout.rows) * layout.cols);
+        for (const Tile& tile : tiles) {
+            cells[cellIndex(tile)] = tile.key;
+        }
+        return cells;
+    }
+
+    // The keys of tiles composed since cellKeys, which lose the GPU suffix
+    // when they fell back to the CPU
+    void updateCellKeys(std::vector<QString>& cells, std::vector<Tile>::const_iterator begin,
+                        std::vector<Tile>::const_iterator end) const {
+        for (auto it = begin; it != end; ++it) {
+            cells[cellIndex(*it)] = it->key;
+        }
+    }
+
+    // Everything an encoded grid row depends on
+    QString bandKey(const std::vector<QString>& cells, int row, const PngWriter& writer) const {
+        QString key = QString("%1|%2|%3x%4").arg(writer.imageWidth()).arg(writer.compressionLevel())
+                          .arg(layout.tile.width()).arg(layout.tile.height());
+        for (int col = 0; col < layout.cols; col++) {
+            key += "\n";
+            key += cells[static_cast<size_t>(row) * layout.cols + col];
+        }
+        return key;
+    }
+
+    // White is all ones in RGB32, a row is one memset
+    void fillCell(QImage& canvas, int row, int col) const {
+        const QSize tile = layout.tile;
+        const size_t rowBytes = static_cast<size_t>(tile.width()) * 4;
+        for (int y = 0; y < tile.height(); y++) {
+            memset(canvas.scanLine(row * tile.height() + y) + static_cast<size_t>(col) * rowBytes, 0xff, rowBytes);
+        }
+    }
+
+    // Every tile overwrites its whole cell, so a fresh canvas is only
+    // filled where no tile of [begin, end) goes. canvas holds rowCount grid
+    // rows starting at firstRow.
+    void fillEmptyCells(QImage& canvas, std::vector<Tile>::iterator begin, std::vector<Tile>::iterator end,
+                        int firstRow, int rowCount) const {
+        std::vector<char> covered(static_cast<size_t>(rowCount) * layout.cols, 0);
+        for (auto it = begin; it != end; ++it) {
+            covered[static_cast<size_t>(it->row - firstRow) * layout.cols + it->col] = 1;
+        }
+        for (int row = 0; row < rowCount; row++) {
+            for (int col = 0; col < layout.cols; col++) {
+                if (!covered[static_cast<size_t>(row) * layout.cols + col]) {
+                    fillCell(canvas, row, col);
+                }
+            }
+        }
+    }
+
+    // Tiles cover disjoint rects of the canvas, so every task writes its rows
+    // directly without a shared painter or locking. canvas starts at grid row
+    // firstRow.
+    void composeTiles(std::vector<Tile>::iterator begin, std::vector<Tile>::iterator end,
+                      QImage& canvas, int firstRow) {
+        if (compositor && composeOnGpu(begin, end, canvas, firstRow)) {
+            return;
+        }
+
+        uchar* bits = canvas.bits();
+        const int stride = canvas.bytesPerLine();
+        const QSize tileSize = layout.tile;
+
+        QtConcurrent::blockingMap(begin, end, [&](Tile& tile) {
+            if (isCancelled()) {
+                return; // drain the remaining tasks without doing work
+            }
+            if (tile.key.endsWith(QLatin1String(gpuKeySuffix))) {
+                tile.key.chop(QLatin1String(gpuKeySuffix).size()); // rendered here after all
+            }
+            uchar* origin = bits + static_cast<size_t>(tile.row - firstRow) * tileSize.height() * stride
+                                 + static_cast<size_t>(tile.col) * tileSize.width() * 4;
+            QImage dest(origin, tileSize.width(), tileSize.height(), stride, QImage::Format_RGB32);
+            QImage cached = tile.key.isEmpty() ? QImage() : renderCache->tile(tile.key);
+            QString diskKey;
+            if (cached.isNull() && diskCache) {
+                diskKey = DiskCache::sourceKey(tile.path, QString("tile|%1x%2|%3").arg(tileSize.width())
+                                               .arg(tileSize.height()).arg(static_cast<int>(filter)));
+                cached = diskCache->load(diskKey);
+                Stats::instance().count(cached.isNull() ? Stats::Counter::DiskMiss : Stats::Counter::DiskHit);
+                if (!cached.isNull() && cached.size() != dest.size()) {
+                    cached = QImage();
+                }
+                if (!cached.isNull() && !tile.key.isEmpty()) {
+                    renderCache->insertTile(tile.key, cached);
+                }
+            }
+            if (!cached.isNull()) {
+                paintTile(cached, dest);
+            } else if (!ensureSource(tile)) {
+                return;
+            } else {
+                renderTile(tile.image, dest, filter);
+                if (!tile.key.isEmpty()) {
+                    renderCache->insertTile(tile.key, PixelPool::instance().copy(dest));
+                }
+                if (!diskKey.isEmpty()) {
+                    diskCache->store(diskKey, dest);
+                }
+            }
+            tile.image = QImage(); // release the source as soon as it is placed
+
+            tilesPlaced(1);
+        });
+    }
+
+    // All tiles of the range in one GL pass. The tile cache is neither read
+    // nor filled here: the GPU renders a tile faster than it is looked up.
+    // The limits that need no source are checked before any is decoded, and
+    // on a failure the sources decoded here go again, so the CPU fallback
+    // holds one per task as usual.
+    bool composeOnGpu(std::vector<Tile>::iterator begin, std::vector<Tile>::iterator end,
+                      QImage& canvas, int firstRow) {
+        if (begin == end || isCancelled() || !compositor->accepts(canvas.width(), layout.tile)) {
+            return false;
+        }
+        std::vector<char> decoded(static_cast<size_t>(end - begin), 0);
+        for (auto it = begin; it != end; ++it) {
+            decoded[static_cast<size_t>(it - begin)] = needsDecode(*it);
+        }
+        QtConcurrent::blockingMap(begin, end, [this](Tile& tile) { ensureSource(tile); });
+        if (sourceFailed()) {
+            return true; // nothing to fall back to, the job fails
+        }
+        auto releaseDecoded = [&]() {
+            for (auto it = begin; it != end; ++it) {
+                if (decoded[static_cast<size_t>(it - begin)]) {
+                    it->image = QImage();
+                }
+            }
+        };
+        std::vector<GlCompositor::Placement> placements;
+        for (auto it = begin; it != end; ++it) {
+            placements.push_back({it->image, Resampler::centerRect(it->image.size(), layout.tile),
+                                  it->col * layout.tile.width(), (it->row - firstRow) * layout.tile.height()});
+        }
+        if (isCancelled()) {
+            releaseDecoded();
+            return false;
+        }
+        {
+            StatsScope scope(Stats::Stage::GpuCompose,
+                             static_cast<qint64>(placements.size()) * layout.tile.width() * layout.tile.height());
+            const bool composed = compositor->compose(placements, layout.tile, canvas);
+            placements.clear();
+            if (!composed) {
+                releaseDecoded();
+                return false;
+            }
+        }
+        for (auto it = begin; it != end; ++it) {
+            it->image = QImage();
+        }
+        tilesPlaced(static_cast<int>(end - begin));
+        return true;
+    }
+};
@@ -0,0 +1,185 @@
+#pragma once
+
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QDir>
+#include <QDirIterator>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QSaveFile>
+#include <QString>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Decoded center squares and rendered tiles kept on disk between sessions,
+// so reopening a layout reads small local files instead of decoding the
+// sources again. Entries are content addressed: the file name is a hash of
+// the source path, its size and mtime and what was made from it, so a changed
+// source simply misses. Pixels are stored raw behind a small header and come
+// back as QImages over a read-only memory mapping of the file; nothing is
+// read until the pixels are touched.
+//
+// Any thread may use it; entries are written through QSaveFile, so readers
+// never see a partial file. trim() keeps the directory under its budget,
+// oldest entries first.
+class DiskCache {
+public:
+    DiskCache(const QString& directory, qint64 budgetBytes) : root(directory), budget(budgetBytes) {}
+
+    DiskCache(const DiskCache&) = delete;
+    DiskCache& operator=(const DiskCache&) = delete;
+
+    // Key of something made from the file at path; what says what it is and
+    // at which size. Empty if the file does not exist.
+    static QString sourceKey(const QString& path, const QString& what) {
+        QFileInfo info(path);
+        if (!info.exists()) {
+            return QString();
+        }
+        const QString identity = QString("%1|%2|%3|%4").arg(info.absoluteFilePath()).arg(info.size())
+            .arg(info.lastModified().toMSecsSinceEpoch()).arg(what);
+        return QString::fromLatin1(QCryptographicHash::hash(identity.toUtf8(), QCryptographicHash::Sha1).toHex());
+    }
+
+    // Null on a miss. sourceSide, if given, gets what was stored with the entry.
+    QImage load(const QString& key, int* sourceSide = nullptr) const {
+        if (key.isEmpty()) {
+            return QImage();
+        }
+        auto* file = new QFile(entryPath(key));
+        Header header;
+        if (!file->open(QIODevice::ReadOnly) ||
+            file->read(reinterpret_cast<char*>(&header), sizeof(header)) != static_cast<qint64>(sizeof(header))) {
+            delete file;
+            return QImage();
+        }
+        // The header comes from disk: checked in 64 bits and against a sane
+        // size before anything is mapped
+        const QImage::Format format = static_cast<QImage::Format>(header.format);
+        if (memcmp(header.magic, "CLT1", 4) != 0 || header.width <= 0 || header.height <= 0 ||
+            header.width > maxSide || header.height > maxSide ||
+            header.bytesPerLine < static_cast<qint64>(header.width) * 4 ||
+            (format != QImage::Format_RGB32 && format != QImage::Format_ARGB32 &&
+             format != QImage::Format_ARGB32_Premultiplied) ||
+            file->size() != static_cast<qint64>(sizeof(Header)) + static_cast<qint64>(header.bytesPerLine) * header.height) {
+            delete file;
+            QFile::remove(entryPath(key)); // damaged or from another version
+            return QImage();
+        }
+        uchar* mapped = file->map(0, file->size());
+        if (!mapped) {
+            delete file;
+            return QImage();
+        }
+        if (sourceSide) {
+            *sourceSide = header.sourceSide;
+        }
+        // The mapping outlives the descriptor, so thousands of cached images
+        // don't hold thousands of open files
+        file->close();
+        // The image owns the mapping: it goes away with the last copy. The
+        // pages are read-only, the const constructor makes a writer detach.
+        return QImage(static_cast<const uchar*>(mapped) + sizeof(Header), header.width, header.height,
+                      header.bytesPerLine, format, releaseMapping, file);
+    }
+
+    // Replaces the entry; RGB32 and premultiplied ARGB32, the formats the
+    // resampler reads in place, are stored as they are, anything else is
+    // converted to one of them first
+    bool store(const QString& key, const QImage& image, int sourceSide = 0) const {
+        if (key.isEmpty() || image.isNull() || image.width() > maxSide || image.height() > maxSide) {
+            return false;
+        }
+        QImage pixels = image;
+        if (pixels.format() != QImage::Format_RGB32 && pixels.format() != QImage::Format_ARGB32_Premultiplied) {
+            pixels = pixels.convertToFormat(pixels.hasAlphaChannel() ? QImage::Format_ARGB32_Premultiplied
+                                                                     : QImage::Format_RGB32);
+        }
+        const QString path = entryPath(key);
+        if (!QDir().mkpath(QFileInfo(path).absolutePath())) {
+            return false;
+        }
+
+        Header header;
+        memcpy(header.magic, "CLT1", 4);
+        header.width = pixels.width();
+        header.height = pixels.height();
+        header.bytesPerLine = pixels.width() * 4;
+        header.format = static_cast<qint32>(pixels.format());
+        header.sourceSide = sourceSide;
+
+        QSaveFile file(path);
+        if (!file.open(QIODevice::WriteOnly) ||
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header)) != static_cast<qint64>(sizeof(header))) {
+            return false;
+        }
+        for (int y = 0; y < pixels.height(); y++) {
+            if (file.write(reinterpret_cast<const char*>(pixels.constScanLine(y)), header.bytesPerLine) != header.bytesPerLine) {
+                return false;
+            }
+        }
+        return file.commit();
+    }
+
+    // Deletes the oldest entries until the directory fits the budget
+    void trim() const {
+        struct Entry {
+            QString path;
+            qint64 size;
+            qint64 modified;
+        };
+        std::vector<Entry> entries;
+        qint64 total = 0;
+        QDirIterator it(root, QStringList() << "*.tile", QDir::Files, QDirIterator::Subdirectories);
+        while (it.hasNext()) {
+            it.next();
+            const QFileInfo info = it.fileInfo();
+            entries.push_back({info.filePath(), info.size(), info.lastModified().toMSecsSinceEpoch()});
+            total += info.size();
+        }
+        if (total <= budget) {
+            return;
+        }
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) {
+            return a.modified < b.modified;
+        });
+        for (const Entry& entry : entries) {
+            if (total <= budget) break;
+            if (QFile::remove(entry.path)) {
+                total -= entry.size;
+            }
+        }
+    }
+
+    QString directory() const { return root; }
+
+private:
+    // 32 bytes, so the rows that follow stay 16-byte aligned in the mapping
+    struct Header {
+        char magic[4];
+        qint32 width;
+        qint32 height;
+        qint32 bytesPerLine;
+        qint32 format;      // QImage::Format
+        qint32 sourceSide;  // ImageData::sourceSize for decoded squares
+        qint32 reserved[2] = {0, 0};
+    };
+    static_assert(sizeof(Header) == 32, "tile header layout");
+
+    // Larger than any collage; a header past it is damaged
+    static constexpr qint32 maxSide = 1 << 16;
+
+    QString root;
+    qint64 budget;
+
+    // Two-level fan-out keeps directories small
+    QString entryPath(const QString& key) const {
+        return QDir(root).filePath(key.left(2) + "/" + key.mid(2) + ".tile");
+    }
+
+    static void releaseMapping(void* file) {
+        delete static_cast<QFile*>(file);
+    }
+};
@@ -0,0 +1,226 @@
+#pragma once
+
+#include <QCoreApplication>
+#include <QGuiApplication>
+#include <QImage>
+#include <QMutex>
+#include <QRect>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#ifndef QT_NO_OPENGL
+#include <QOffscreenSurface>
+#include <QOpenGLContext>
+#include <QOpenGLFramebufferObject>
+#include <QOpenGLFunctions>
+#include <QOpenGLShaderProgram>
+#include <QOpenGLTexture>
+#endif
+
+// Optional GPU compose for CollageWorker: each tile's source is uploaded as
+// a mipmapped texture and drawn with trilinear filtering into an offscreen
+// framebuffer one band of tile rows high, and every band is read back in one
+// transfer. Trilinear filtering is softer than the CPU resampler's Lanczos3,
+// so the GUI only uses it when asked to.
+//
+// Construct it on the GUI thread; compose() may then be called from any
+// thread, one call at a time. Without a GL platform (no QGuiApplication, as
+// in --batch mode, or no threaded GL) isAvailable() is false and compose()
+// always fails, which sends the worker down the CPU path.
+class GlCompositor {
+public:
+    // The sourceRect of source scaled into the tileSize rect whose top
+    // left corner is at (x, y) in the canvas
+    struct Placement {
+        QImage source;
+        QRect sourceRect;
+        int x;
+        int y;
+    };
+
+    GlCompositor() {
+#ifndef QT_NO_OPENGL
+        if (!qobject_cast<QGuiApplication*>(QCoreApplication::instance()) ||
+            !QOpenGLContext::supportsThreadedOpenGL()) {
+            return;
+        }
+        surface = new QOffscreenSurface();
+        surface->setFormat(QSurfaceFormat::defaultFormat());
+        surface->create();
+
+        QOpenGLContext context;
+        context.setFormat(surface->format());
+        if (!surface->isValid() || !context.create() || !context.makeCurrent(surface)) {
+            return;
+        }
+        GLint textureSize = 0;
+        GLint renderbufferSize = 0;
+        context.functions()->glGetIntegerv(GL_MAX_TEXTURE_SIZE, &textureSize);
+        context.functions()->glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &renderbufferSize);
+        maxSize = std::min(textureSize, renderbufferSize);
+        available = maxSize > 0 && QOpenGLFramebufferObject::hasOpenGLFramebufferObjects();
+        context.doneCurrent();
+#endif
+    }
+
+    ~GlCompositor() {
+#ifndef QT_NO_OPENGL
+        // The last owner may be a worker thread; the surface belongs to the GUI one
+        if (surface) {
+            surface->deleteLater();
+        }
+#endif
+    }
+
+    GlCompositor(const GlCompositor&) = delete;
+    GlCompositor& operator=(const GlCompositor&) = delete;
+
+    bool isAvailable() const { return available; }
+
+    // The size limits of compose() that don't depend on the sources, so a
+    // caller can check them before decoding any
+    bool accepts(int canvasWidth, const QSize& tileSize) const {
+        return available && canvasWidth <= maxSize && tileSize.width() <= maxSize && tileSize.height() <= maxSize;
+    }
+
+    // Draws the placements into their tile rects of canvas, an RGB32 image
+    // or view; the rest of canvas is left alone. False on any GL failure or
+    // size limit, in which case the caller composes the tiles on the CPU.
+    bool compose(const std::vector<Placement>& placements, const QSize& tileSize, QImage& canvas) {
+#ifndef QT_NO_OPENGL
+        if (placements.empty() || !accepts(canvas.width(), tileSize)) {
+            return false;
+        }
+        for (const Placement& placement : placements) {
+            if (placement.sourceRect.width() > maxSize || placement.sourceRect.height() > maxSize) {
+                return false;
+            }
+        }
+
+        QMutexLocker locker(&mutex);
+        QOpenGLContext context;
+        context.setFormat(surface->format());
+        if (!context.create() || !context.makeCurrent(surface)) {
+            return false;
+        }
+        // GL objects live in drawBands, so they go before the context does
+        bool drawn = drawBands(context, placements, tileSize, canvas);
+        context.doneCurrent();
+        return drawn;
+#else
+        Q_UNUSED(placements);
+        Q_UNUSED(tileSize);
+        Q_UNUSED(canvas);
+        return false;
+#endif
+    }
+
+private:
+    bool available = false;
+    int maxSize = 0;
+    QMutex mutex;
+
+#ifndef QT_NO_OPENGL
+    QOffscreenSurface* surface = nullptr;
+
+    static constexpr const char* vertexShader =
+        "attribute highp vec2 position;\n"
+        "attribute highp vec2 texCoord;\n"
+        "varying highp vec2 uv;\n"
+        "void main() {\n"
+        "    uv = texCoord;\n"
+        "    gl_Position = vec4(position, 0.0, 1.0);\n"
+        "}\n";
+
+    // Transparent sources sit on white, as in Resampler::resample
+    static constexpr const char* fragmentShader =
+        "uniform sampler2D source;\n"
+        "varying highp vec2 uv;\n"
+        "void main() {\n"
+        "    mediump vec4 color = texture2D(source, uv);\n"
+        "    gl_FragColor = vec4(mix(vec3(1.0), color.rgb, color.a), 1.0);\n"
+        "}\n";
+
+    static bool drawBands(QOpenGLContext& context, const std::vector<Placement>& placements,
+                          const QSize& tileSize, QImage& canvas) {
+        QOpenGLFunctions* gl = context.functions();
+        QOpenGLShaderProgram program;
+        if (!program.addShaderFromSourceCode(QOpenGLShader::Vertex, vertexShader) ||
+            !program.addShaderFromSourceCode(QOpenGLShader::Fragment, fragmentShader) ||
+            !program.link()) {
+            return false;
+        }
+
+        const int width = canvas.width();
+        QOpenGLFramebufferObject fbo(width, tileSize.height());
+        if (!fbo.isValid() || !fbo.bind() || !program.bind()) {
+            return false;
+        }
+        gl->glViewport(0, 0, width, tileSize.height());
+        gl->glDisable(GL_BLEND);
+        gl->glDisable(GL_DEPTH_TEST);
+
+        const int position = program.attributeLocation("position");
+        const int texCoord = program.attributeLocation("texCoord");
+        // Texture rows are uploaded top first and the band is read back
+        // flipped, so t = 0 goes to the top edge (NDC y = +1)
+        static const float texCoords[] = {0.0f, 0.0f, 1.0f, 0.0f, 0.0f, 1.0f, 1.0f, 1.0f};
+        program.setUniformValue("source", 0);
+        program.enableAttributeArray(position);
+        program.enableAttributeArray(texCoord);
+        program.setAttributeArray(texCoord, texCoords, 2);
+
+        std::vector<int> bandTops;
+        for (const Placement& placement : placements) {
+            bandTops.push_back(placement.y);
+        }
+        std::sort(bandTops.begin(), bandTops.end());
+        bandTops.erase(std::unique(bandTops.begin(), bandTops.end()), bandTops.end());
+
+        bool drawn = true;
+        for (int top : bandTops) {
+            gl->glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
+            gl->glClear(GL_COLOR_BUFFER_BIT);
+            for (const Placement& placement : placements) {
+                if (placement.y != top) continue;
+                QImage pixels = placement.sourceRect == placement.source.rect()
+                    ? placement.source
+                    : placement.source.copy(placement.sourceRect);
+                QOpenGLTexture texture(pixels);
+                texture.setMinMagFilters(QOpenGLTexture::LinearMipMapLinear, QOpenGLTexture::Linear);
+                texture.setWrapMode(QOpenGLTexture::ClampToEdge);
+
+                const float left = 2.0f * placement.x / width - 1.0f;
+                const float right = 2.0f * (placement.x + tileSize.width()) / width - 1.0f;
+                const float vertices[] = {left, 1.0f, right, 1.0f, left, -1.0f, right, -1.0f};
+                program.setAttributeArray(position, vertices, 2);
+                texture.bind();
+                gl->glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+                texture.release();
+            }
+
+            // The whole band in one readback, then only the drawn tiles are copied
+            const QImage band = fbo.toImage().convertToFormat(QImage::Format_RGB32);
+            if (band.isNull()) {
+                drawn = false;
+                break;
+            }
+            const size_t rowBytes = static_cast<size_t>(tileSize.width()) * 4;
+            for (const Placement& placement : placements) {
+                if (placement.y != top) continue;
+                const size_t offset = static_cast<size_t>(placement.x) * 4;
+                for (int y = 0; y < tileSize.height(); y++) {
+                    memcpy(canvas.scanLine(top + y) + offset, band.constScanLine(y) + offset, rowBytes);
+                }
+            }
+        }
+
+        program.disableAttributeArray(position);
+        program.disableAttributeArray(texCoord);
+        program.release();
+        fbo.release();
+        return drawn;
+    }
+#endif
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <QImage>
+#include <QString>
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+// One decoded source. image holds only the center crop of the file, a
+// square unless the collage's tiles are not, decoded at no more than the
+// tile size the current grid can use; sourceSize is the side of the
+// file's center square.
+struct SourceImage {
+    QString path;
+    QImage image;
+    int sourceSize = 0;
+};
+
+// The decoded sources of a grid as a flat rows * cols array of handles in
+// row-major order. Entries are shared and never modified in
+// place, so copying a store copies only the handles: the GUI and every
+// export job use the same pixel buffers, and a worker's copy is a snapshot
+// that later edits in the GUI don't touch. Not thread-safe itself, give
+// each thread its own copy.
+class ImageStore {
+public:
+    using Handle = std::shared_ptr<const SourceImage>;
+
+    ImageStore() = default;
+    ImageStore(int rows, int cols)
+        : rowCount(rows), colCount(cols), entries(static_cast<size_t>(rows) * cols) {}
+    explicit ImageStore(int gridSize) : ImageStore(gridSize, gridSize) {}
+
+    int rows() const { return rowCount; }
+    int cols() const { return colCount; }
+
+    // Null for an empty cell and for one outside the grid
+    const Handle& at(int row, int col) const {
+        static const Handle none;
+        return contains(row, col) ? entries[index(row, col)] : none;
+    }
+
+    void set(int row, int col, Handle handle) {
+        if (contains(row, col)) {
+            entries[index(row, col)] = std::move(handle);
+        }
+    }
+
+    void set(int row, int col, SourceImage image) {
+        set(row, col, std::make_shared<const SourceImage>(std::move(image)));
+    }
+
+    void remove(int row, int col) {
+        set(row, col, Handle());
+    }
+
+    // Keeps the entries where the old and new grids overlap
+    void resize(int newRows, int newCols) {
+        ImageStore resized(newRows, newCols);
+        for (int row = 0; row < std::min(rowCount, newRows); row++) {
+            for (int col = 0; col < std::min(colCount, newCols); col++) {
+                resized.entries[resized.index(row, col)] = std::move(entries[index(row, col)]);
+            }
+        }
+        *this = std::move(resized);
+    }
+
+    void resize(int gridSize) {
+        resize(gridSize, gridSize);
+    }
+
+    int count() const {
+        int filled = 0;
+        for (const Handle& entry : entries) {
+            if (entry) filled++;
+        }
+        return filled;
+    }
+
+    bool empty() const { return count() == 0; }
+
+    // f(row, col, const SourceImage&) for every filled cell, row-major
+    template <typename Function>
+    void forEach(Function f) const {
+        for (int row = 0; row < rowCount; row++) {
+            for (int col = 0; col < colCount; col++) {
+                const Handle& entry = entries[index(row, col)];
+                if (entry) f(row, col, *entry);
+            }
+        }
+    }
+
+private:
+    int rowCount = 0;
+    int colCount = 0;
+    std::vector<Handle> entries;
+
+    bool contains(int row, int col) const {
+        return row >= 0 && col >= 0 && row < rowCount && col < colCount;
+    }
+
+    size_t index(int row, int col) const {
+        return static_cast<size_t>(row) * colCount + col;
+    }
+};
@@ -4,7 +4,11 @@
 #include <QLabel>
 #include <QPushButton>
 #include <QSpinBox>
-#include <QGridLayout>
+#include <QComboBox>
+#include <QCheckBox>
+#include <QAbstractScrollArea>
+#include <QScrollBar>
+#include <QToolTip>
 #include <QVBoxLayout>
 #include <QHBoxLayout>
 #include <QFrame>
@@ -14,238 +18,663 @@
 #include <QImage>
 #include <QDragEnterEvent>
 #include <QDropEvent>
+#include <QResizeEvent>
 #include <QMimeData>
 #include <QTimer>
+#include <QElapsedTimer>
+#include <QSignalBlocker>
 #include <QProgressDialog>
 #include <QThread>
+#include <QThreadPool>
 #include <QGroupBox>
+#include <QFileInfo>
+#include <QDir>
+#include <QStandardPaths>
 #include <QPainter>
+#include <QFutureWatcher>
+#include <QtConcurrent>
+#include <list>
+#include <algorithm>
 #include <map>
 #include <memory>
-
-// Worker class for collage creation in separate thread
-class CollageWorker : public QObject {
-    Q_OBJECT
+#include <atomic>
+#include <functional>
+
+#include "collageworker.h"
+#include "batch.h"
+#include "server.h"
+
+// Prescaled thumbnails for the grid cells. Each source path keeps a chain of
+// power-of-two reduced squares, so a cell resize only needs one final scale
+// of less than 2x from the nearest level. Entries are evicted least recently
+// used first once the memory budget is exceeded. GUI thread only.
+class ThumbnailCache {
 public:
-    struct ImageData {
-        QString path;
-        QImage image;
-    };
+    explicit ThumbnailCache(qint64 budgetBytes) : budget(budgetBytes), usedBytes(0) {}
+
+    // Stops halving below this side, cells are never smaller than 50 px
+    static constexpr int minLevelSize = 64;
+
+    // Safe to call off the GUI thread: only touches the given image
+    static std::vector<QImage> buildMipChain(const QImage& square) {
+        std::vector<QImage> levels;
+        if (square.isNull()) return levels;
+        levels.push_back(square);
+        while (levels.back().width() / 2 >= minLevelSize) {
+            int side = levels.back().width() / 2;
+            // An exact 2:1 step, the box filter is a plain 2x2 average
+            levels.push_back(Resampler::scaled(levels.back(), side, side, Resampler::Filter::Box));
+        }
+        return levels;
+    }
 
-    CollageWorker(const std::map<std::pair<int,int>, ImageData>& data, 
-                  int gridSize, int maxSize, const QString& outputPath)
-        : imageData(data), gridSize(gridSize), maxCollageSize(maxSize), outputPath(outputPath) {}
+    void insert(const QString& path, std::vector<QImage> levels, const QImage& thumbnail = QImage()) {
+        remove(path);
+        if (levels.empty()) return;
+
+        lru.push_front(path);
+        Entry& entry = entries[path];
+        entry.levels = std::move(levels);
+        entry.lruPos = lru.begin();
+        if (!thumbnail.isNull()) {
+            entry.pixmap = QPixmap::fromImage(thumbnail);
+            entry.pixmapSize = thumbnail.width();
+        }
+        entry.bytes = entryBytes(entry);
+        usedBytes += entry.bytes;
+        evict();
+    }
 
-signals:
-    void finished(bool success, QString message);
-    void progress(int value);
-
-public slots:
-    void process() {
-        try {
-            std::vector<QImage> images;
-            for (int i = 0; i < gridSize; i++) {
-                for (int j = 0; j < gridSize; j++) {
-                    auto it = imageData.find({i, j});
-                    if (it != imageData.end()) {
-                        images.push_back(it->second.image);
-                    } else {
-                        images.push_back(QImage());
-                    }
-                }
+    // Null pixmap on a miss (never inserted or already evicted)
+    QPixmap thumbnail(const QString& path, int cellSize) {
+        auto it = entries.find(path);
+        if (it == entries.end()) {
+            Stats::instance().count(Stats::Counter::ThumbnailMiss);
+            return QPixmap();
+        }
+
+        Entry& entry = it->second;
+        lru.splice(lru.begin(), lru, entry.lruPos);
+
+        if (entry.pixmap.isNull() || entry.pixmapSize != cellSize) {
+            Stats::instance().count(Stats::Counter::ThumbnailMiss);
+            StatsScope scope(Stats::Stage::Thumbnail, static_cast<qint64>(cellSize) * cellSize);
+            // Smallest level that is still not smaller than the cell
+            const QImage* source = &entry.levels.front();
+            for (const QImage& level : entry.levels) {
+                if (level.width() < cellSize) break;
+                source = &level;
             }
+            QImage scaled = source->width() == cellSize
+                ? *source
+                : Resampler::scaled(*source, cellSize, cellSize);
+
+            usedBytes -= entry.bytes;
+            entry.pixmap = QPixmap::fromImage(scaled);
+            entry.pixmapSize = cellSize;
+            entry.bytes = entryBytes(entry);
+            usedBytes += entry.bytes;
+            QPixmap result = entry.pixmap;
+            evict();
+            return result;
+        }
+        Stats::instance().count(Stats::Counter::ThumbnailHit);
+        return entry.pixmap;
+    }
 
-            emit progress(20);
+    // The pixmap last made for path, of whatever size; null on a miss. For
+    // painting, so it never scales.
+    QPixmap pixmap(const QString& path) {
+        auto it = entries.find(path);
+        if (it == entries.end()) return QPixmap();
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return it->second.pixmap;
+    }
 
-            std::vector<QImage> processedImages;
-            int minSize = INT_MAX;
-            
-            for (const auto& img : images) {
-                if (!img.isNull()) {
-                    QImage squared = cropCenterToSquare(img);
-                    processedImages.push_back(squared);
-                    minSize = std::min(minSize, squared.width());
-                } else {
-                    processedImages.push_back(QImage());
-                }
-            }
+    bool hasThumbnail(const QString& path, int cellSize) const {
+        auto it = entries.find(path);
+        return it != entries.end() && !it->second.pixmap.isNull() && it->second.pixmapSize == cellSize;
+    }
 
-            if (minSize == INT_MAX) {
-                emit finished(false, "Нет изображений для создания коллажа!");
-                return;
-            }
+    // The level a cell of this size would be scaled from, null on a miss.
+    // Lets the scale itself run off the GUI thread.
+    QImage sourceLevel(const QString& path, int cellSize) const {
+        auto it = entries.find(path);
+        if (it == entries.end()) return QImage();
+        const QImage* source = &it->second.levels.front();
+        for (const QImage& level : it->second.levels) {
+            if (level.width() < cellSize) break;
+            source = &level;
+        }
+        return *source;
+    }
 
-            emit progress(40);
+    // Stores a thumbnail scaled elsewhere; ignored if the entry is gone
+    void setThumbnail(const QString& path, const QImage& thumbnail) {
+        auto it = entries.find(path);
+        if (it == entries.end() || thumbnail.isNull()) return;
+        Entry& entry = it->second;
+        lru.splice(lru.begin(), lru, entry.lruPos);
+        usedBytes -= entry.bytes;
+        entry.pixmap = QPixmap::fromImage(thumbnail);
+        entry.pixmapSize = thumbnail.width();
+        entry.bytes = entryBytes(entry);
+        usedBytes += entry.bytes;
+        evict();
+    }
 
-            int collageSize = gridSize * minSize;
-            if (collageSize > maxCollageSize) {
-                minSize = maxCollageSize / gridSize;
-                collageSize = gridSize * minSize;
-            }
+    void remove(const QString& path) {
+        auto it = entries.find(path);
+        if (it == entries.end()) return;
+        usedBytes -= it->second.bytes;
+        lru.erase(it->second.lruPos);
+        entries.erase(it);
+    }
 
-            emit progress(60);
-
-            QImage collage(collageSize, collageSize, QImage::Format_RGB32);
-            collage.fill(Qt::white);
-
-            QPainter painter(&collage);
-            
-            for (size_t i = 0; i < processedImages.size(); i++) {
-                if (!processedImages[i].isNull()) {
-                    int row = static_cast<int>(i) / gridSize;
-                    int col = static_cast<int>(i) % gridSize;
-                    
-                    QImage resized = processedImages[i].scaled(minSize, minSize, 
-                                                               Qt::IgnoreAspectRatio, 
-                                                               Qt::SmoothTransformation);
-                    painter.drawImage(col * minSize, row * minSize, resized);
-                }
-                
-                emit progress(60 + (static_cast<int>(i) * 35) / static_cast<int>(processedImages.size()));
-            }
+    void setBudget(qint64 budgetBytes) {
+        budget = budgetBytes;
+        evict();
+    }
 
-            emit progress(95);
+    qint64 budgetBytes() const { return budget; }
+    qint64 memoryUsage() const { return usedBytes; }
 
-            bool saved = collage.save(outputPath, "PNG", 100);
-            
-            emit progress(100);
+private:
+    struct Entry {
+        std::vector<QImage> levels; // largest first
+        QPixmap pixmap;             // last size requested by the grid
+        int pixmapSize = 0;
+        qint64 bytes = 0;
+        std::list<QString>::iterator lruPos;
+    };
 
-            if (saved) {
-                emit finished(true, QString("Коллаж %1x%1 сохранен как:\n%2")
-                             .arg(collageSize).arg(outputPath));
-            } else {
-                emit finished(false, "Ошибка сохранения файла!");
-            }
+    std::map<QString, Entry> entries;
+    std::list<QString> lru; // most recently used first
+    qint64 budget;
+    qint64 usedBytes;
 
-        } catch (const std::exception& e) {
-            emit finished(false, QString("Ошибка: %1").arg(e.what()));
+    static qint64 entryBytes(const Entry& entry) {
+        qint64 bytes = static_cast<qint64>(entry.pixmap.width()) * entry.pixmap.height() * 4;
+        for (const QImage& level : entry.levels) {
+            bytes += static_cast<qint64>(level.bytesPerLine()) * level.height();
         }
+        return bytes;
     }
 
-private:
-    std::map<std::pair<int,int>, ImageData> imageData;
-    int gridSize;
-    int maxCollageSize;
-    QString outputPath;
-
-    QImage cropCenterToSquare(const QImage& img) {
-        int width = img.width();
-        int height = img.height();
-        int newSize = std::min(width, height);
-        int left = (width - newSize) / 2;
-        int top = (height - newSize) / 2;
-        return img.copy(left, top, newSize, newSize);
+    void evict() {
+        // The most recent entry always stays, even if it alone is over budget
+        while (usedBytes > budget && lru.size() > 1) {
+            remove(lru.back());
+        }
     }
 };
 
-// Custom label for drag & drop cells
-class ImageCell : public QLabel {
+// The grid as one scrolling widget. Cells are not widgets: each paint draws
+// only the cells in the viewport and asks the owner for their state and
+// thumbnail, so memory and paint time follow the viewport, not the number
+// of cells. Cells shrink to fit the window down to minCellSize; larger
+// grids scroll.
+class GridView : public QAbstractScrollArea {
     Q_OBJECT
 public:
-    ImageCell(int row, int col, QWidget* parent = nullptr) 
-        : QLabel(parent), row(row), col(col), hasImage(false) {
+    enum class CellState { Empty, Loading, Loaded };
+
+    struct Cell {
+        CellState state = CellState::Empty;
+        QPixmap thumbnail;  // any size, drawn scaled to the cell
+        QString path;
+    };
+
+    // Called for every painted cell, so it must be cheap
+    using CellSource = std::function<Cell(int row, int col)>;
+
+    static constexpr int minCellSize = 50;
+
+    explicit GridView(QWidget* parent = nullptr) : QAbstractScrollArea(parent) {
         setAcceptDrops(true);
-        setAlignment(Qt::AlignCenter);
-        setStyleSheet("QLabel { background-color: lightgray; border: 1px solid gray; }");
-        setFrameStyle(QFrame::Box);
-        setText(QString("%1x%2").arg(row+1).arg(col+1));
-        setMinimumSize(50, 50);
+        viewport()->setAcceptDrops(true);
+        setStyleSheet("QAbstractScrollArea { background-color: #f0f0f0; border: 2px solid gray; }");
+    }
+
+    void setCellSource(CellSource source) {
+        cellSource = std::move(source);
+    }
+
+    int gridSize() const { return size; }
+    int cellSize() const { return cell; }
+
+    void setGridSize(int gridSize) {
+        size = gridSize;
+        dropTarget = -1;
+        updateScrollBars();
+        viewport()->update();
+    }
+
+    // Largest cell size at which the whole grid fits the viewport, but not
+    // below minCellSize. True if the size changed.
+    bool fitCells() {
+        const QSize available = maximumViewportSize() - QSize(2 * margin, 2 * margin);
+        if (available.width() <= 1 || available.height() <= 1 || size <= 0) {
+            return false;
+        }
+        const int fit = std::min(available.width() - spacing * (size - 1),
+                                 available.height() - spacing * (size - 1)) / size;
+        const int fitted = std::max(fit, minCellSize);
+        if (fitted == cell) {
+            return false;
+        }
+        cell = fitted;
+        updateScrollBars();
+        viewport()->update();
+        return true;
     }
 
-    void setImageData(const QPixmap& pixmap, const QString& filename) {
-        setPixmap(pixmap);
-        hasImage = true;
-        setStyleSheet("QLabel { background-color: lightgreen; border: 1px solid gray; }");
-        setToolTip(filename);
+    bool isCellVisible(int row, int col) const {
+        return viewport()->rect().intersects(cellRect(row, col));
     }
 
-    void clearImage() {
-        clear();
-        hasImage = false;
-        setStyleSheet("QLabel { background-color: lightgray; border: 1px solid gray; }");
-        setText(QString("%1x%2").arg(row+1).arg(col+1));
-        setToolTip("");
+    // f(row, col) for the cells at least partly in the viewport, row-major
+    template <typename Function>
+    void forEachVisibleCell(Function f) const {
+        const QRect range = cellRange(viewport()->rect());
+        for (int row = range.top(); row <= range.bottom(); row++) {
+            for (int col = range.left(); col <= range.right(); col++) {
+                f(row, col);
+            }
+        }
     }
 
-    bool isEmpty() const { return !hasImage; }
-    int getRow() const { return row; }
-    int getCol() const { return col; }
+    void updateCell(int row, int col) {
+        viewport()->update(cellRect(row, col));
+    }
 
 signals:
-    void imageDropped(int row, int col, QString filePath);
+    // Every dropped file or folder, in drop order
+    void filesDropped(int row, int col, QStringList paths);
+    // After a scroll or resize: other cells may have come into view
+    void visibleCellsChanged();
 
 protected:
+    void paintEvent(QPaintEvent* event) override {
+        QPainter painter(viewport());
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        const QRect range = cellRange(event->rect());
+        for (int row = range.top(); row <= range.bottom(); row++) {
+            for (int col = range.left(); col <= range.right(); col++) {
+                paintCell(painter, row, col);
+            }
+        }
+    }
+
+    void resizeEvent(QResizeEvent* event) override {
+        QAbstractScrollArea::resizeEvent(event);
+        updateScrollBars();
+        emit visibleCellsChanged();
+    }
+
+    void scrollContentsBy(int, int) override {
+        viewport()->update();
+        emit visibleCellsChanged();
+    }
+
+    bool viewportEvent(QEvent* event) override {
+        if (event->type() == QEvent::ToolTip) {
+            auto* help = static_cast<QHelpEvent*>(event);
+            const int index = cellAt(help->pos());
+            const QString path = index >= 0 && cellSource ? cellSource(index / size, index % size).path : QString();
+            if (path.isEmpty()) {
+                QToolTip::hideText();
+            } else {
+                QToolTip::showText(help->globalPos(), QFileInfo(path).fileName(), viewport());
+            }
+            return true;
+        }
+        return QAbstractScrollArea::viewportEvent(event);
+    }
+
     void dragEnterEvent(QDragEnterEvent* event) override {
         if (event->mimeData()->hasUrls()) {
             event->acceptProposedAction();
-            setStyleSheet("QLabel { background-color: lightyellow; border: 2px solid blue; }");
+            setDropTarget(cellAt(event->pos()));
         }
     }
 
-    void dragLeaveEvent(QDragLeaveEvent* event) override {
-        if (hasImage) {
-            setStyleSheet("QLabel { background-color: lightgreen; border: 1px solid gray; }");
+    void dragMoveEvent(QDragMoveEvent* event) override {
+        setDropTarget(cellAt(event->pos()));
+        if (dropTarget >= 0) {
+            event->acceptProposedAction();
         } else {
-            setStyleSheet("QLabel { background-color: lightgray; border: 1px solid gray; }");
+            event->ignore();
         }
     }
 
+    void dragLeaveEvent(QDragLeaveEvent*) override {
+        setDropTarget(-1);
+    }
+
     void dropEvent(QDropEvent* event) override {
+        const int index = cellAt(event->pos());
+        setDropTarget(-1);
         const QMimeData* mimeData = event->mimeData();
-        if (mimeData->hasUrls()) {
-            QList<QUrl> urls = mimeData->urls();
-            if (!urls.isEmpty()) {
-                QString filePath = urls.first().toLocalFile();
-                emit imageDropped(row, col, filePath);
+        if (index < 0 || !mimeData->hasUrls()) {
+            return;
+        }
+        QStringList paths;
+        for (const QUrl& url : mimeData->urls()) {
+            if (url.isLocalFile()) {
+                paths.append(url.toLocalFile());
             }
         }
-        
-        if (hasImage) {
-            setStyleSheet("QLabel { background-color: lightgreen; border: 1px solid gray; }");
+        if (!paths.isEmpty()) {
+            emit filesDropped(index / size, index % size, paths);
+        }
+    }
+
+private:
+    static constexpr int spacing = 2;
+    static constexpr int margin = 10;
+
+    int size = 0;
+    int cell = minCellSize;
+    int dropTarget = -1; // row * size + col under a drag
+    CellSource cellSource;
+
+    int pitch() const { return cell + spacing; }
+
+    int contentSide() const {
+        return size > 0 ? 2 * margin + size * cell + (size - 1) * spacing : 0;
+    }
+
+    // Top left corner of the content in viewport coordinates: centered
+    // while it fits, scrolled otherwise
+    QPoint origin() const {
+        const QSize area = viewport()->size();
+        const int side = contentSide();
+        return QPoint(side < area.width() ? (area.width() - side) / 2 : -horizontalScrollBar()->value(),
+                      side < area.height() ? (area.height() - side) / 2 : -verticalScrollBar()->value());
+    }
+
+    QRect cellRect(int row, int col) const {
+        const QPoint corner = origin() + QPoint(margin + col * pitch(), margin + row * pitch());
+        return QRect(corner, QSize(cell, cell));
+    }
+
+    // row * size + col of the cell under pos, -1 between and outside cells
+    int cellAt(const QPoint& pos) const {
+        const QPoint local = pos - origin() - QPoint(margin, margin);
+        if (local.x() < 0 || local.y() < 0) return -1;
+        const int col = local.x() / pitch();
+        const int row = local.y() / pitch();
+        if (col >= size || row >= size || local.x() % pitch() >= cell || local.y() % pitch() >= cell) {
+            return -1;
+        }
+        return row * size + col;
+    }
+
+    // Rows and columns of the cells touching area (columns as x, rows as
+    // y); empty if none does
+    QRect cellRange(const QRect& area) const {
+        if (size <= 0) return QRect();
+        const QPoint corner = origin() + QPoint(margin, margin);
+        auto first = [this](int offset) { return std::max(0, offset / pitch()); };
+        auto last = [this](int offset) { return std::min(size - 1, offset / pitch()); };
+        const int left = first(area.left() - corner.x());
+        const int top = first(area.top() - corner.y());
+        const int right = last(area.right() - corner.x());
+        const int bottom = last(area.bottom() - corner.y());
+        if (area.right() < corner.x() || area.bottom() < corner.y()) return QRect();
+        return QRect(QPoint(left, top), QPoint(right, bottom));
+    }
+
+    void updateScrollBars() {
+        const QSize area = viewport()->size();
+        const int side = contentSide();
+        horizontalScrollBar()->setRange(0, std::max(0, side - area.width()));
+        verticalScrollBar()->setRange(0, std::max(0, side - area.height()));
+        horizontalScrollBar()->setPageStep(area.width());
+        verticalScrollBar()->setPageStep(area.height());
+        horizontalScrollBar()->setSingleStep(pitch());
+        verticalScrollBar()->setSingleStep(pitch());
+    }
+
+    void setDropTarget(int index) {
+        if (index == dropTarget) return;
+        if (dropTarget >= 0) updateCell(dropTarget / size, dropTarget % size);
+        dropTarget = index;
+        if (dropTarget >= 0) updateCell(dropTarget / size, dropTarget % size);
+    }
+
+    void paintCell(QPainter& painter, int row, int col) {
+        const QRect rect = cellRect(row, col);
+        const Cell state = cellSource ? cellSource(row, col) : Cell();
+        const bool target = row * size + col == dropTarget;
+        QColor background = state.state == CellState::Loaded ? QColor("lightgreen")
+                          : state.state == CellState::Loading ? QColor("lightyellow")
+                          : QColor("lightgray");
+        if (target) {
+            background = QColor("lightyellow");
+        }
+        painter.fillRect(rect, background);
+        if (!state.thumbnail.isNull()) {
+            painter.drawPixmap(rect, state.thumbnail);
         } else {
-            setStyleSheet("QLabel { background-color: lightgray; border: 1px solid gray; }");
+            painter.setPen(QColor("black"));
+            painter.drawText(rect, Qt::AlignCenter, state.state == CellState::Loading
+                             ? QString("Загрузка...") : QString("%1x%2").arg(row + 1).arg(col + 1));
         }
+        painter.setPen(target ? QPen(QColor("blue"), 2) : QPen(QColor("gray")));
+        painter.drawRect(rect.adjusted(0, 0, -1, -1));
+    }
+};
+
+// The collage at low resolution. The owner composes it into canvas(); the
+// view only draws it scaled to fit, keeping its aspect ratio.
+class PreviewView : public QWidget {
+public:
+    explicit PreviewView(QWidget* parent = nullptr) : QWidget(parent) {
+        setFixedHeight(220);
+    }
+
+    // Written in place by the owner, then update() to show it
+    QImage& canvas() { return image; }
+
+protected:
+    void paintEvent(QPaintEvent*) override {
+        QPainter painter(this);
+        painter.fillRect(rect(), QColor("#f0f0f0"));
+        if (image.isNull()) return;
+        const QSize target = image.size().scaled(size(), Qt::KeepAspectRatio);
+        const QRect area(QPoint((width() - target.width()) / 2, (height() - target.height()) / 2), target);
+        painter.setRenderHint(QPainter::SmoothPixmapTransform);
+        painter.drawImage(area, image);
+        painter.setPen(QColor("gray"));
+        painter.drawRect(area.adjusted(0, 0, -1, -1));
     }
 
 private:
-    int row, col;
-    bool hasImage;
+    QImage image;
 };
 
 class CollageApp : public QMainWindow {
     Q_OBJECT
 public:
-    CollageApp(QWidget* parent = nullptr) : QMainWindow(parent), gridSize(3), maxCollageSize(4000) {
+    CollageApp(QWidget* parent = nullptr)
+        : QMainWindow(parent), gridSize(3), maxCollageSize(4000), images(gridSize),
+          thumbnailCache(256LL * 1024 * 1024),
+          renderCache(std::make_shared<RenderCache>(512LL * 1024 * 1024)),
+          glCompositor(std::make_shared<GlCompositor>()),
+          diskCache(std::make_shared<DiskCache>(
+              QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("tiles"),
+              2LL * 1024 * 1024 * 1024)) {
+        exportPool.setMaxThreadCount(1);
         setupUI();
         
-        // Таймер для проверки размера окна
-        checkSizeTimer = new QTimer(this);
-        connect(checkSizeTimer, &QTimer::timeout, this, &CollageApp::checkWindowSize);
-        checkSizeTimer->start(500); // Проверяем каждые 500ms
-        
+        // Relayout once the window stops changing size
+        relayoutTimer = new QTimer(this);
+        relayoutTimer->setSingleShot(true);
+        relayoutTimer->setInterval(150);
+        connect(relayoutTimer, &QTimer::timeout, this, &CollageApp::applyWindowSize);
+
+        // One frame budget of preview cells per tick
+        previewTimer = new QTimer(this);
+        previewTimer->setSingleShot(true);
+        previewTimer->setInterval(0);
+        connect(previewTimer, &QTimer::timeout, this, &CollageApp::composePreview);
+
+        flushLoadsTimer = new QTimer(this);
+        flushLoadsTimer->setSingleShot(true);
+        flushLoadsTimer->setInterval(100);
+        connect(flushLoadsTimer, &QTimer::timeout, this, &CollageApp::flushLoadedImages);
+
         QTimer::singleShot(100, this, &CollageApp::initializeGrid);
+
+        // Off the GUI thread, walking the cache directory takes a while
+        std::shared_ptr<DiskCache> cache = diskCache;
+        QtConcurrent::run([cache]() { cache->trim(); });
     }
 
 private:
     int gridSize;
     int maxCollageSize;
-    std::map<std::pair<int,int>, CollageWorker::ImageData> imageData;
+    // Decoded sources of the grid, shared with the thumbnail cache and the
+    // export jobs without copying pixels
+    ImageStore images;
+    ThumbnailCache thumbnailCache;
+    // Tiles, collage and PNG bands of earlier exports, shared with the workers
+    std::shared_ptr<RenderCache> renderCache;
+    // Made here because its offscreen surface has to live on the GUI thread
+    std::shared_ptr<GlCompositor> glCompositor;
+    // Decoded squares and tiles of earlier sessions
+    std::shared_ptr<DiskCache> diskCache;
+    // One export at a time, on a thread kept between exports instead of a
+    // new QThread each
+    QThreadPool exportPool;
+
+    // Результат фоновой загрузки: исходник и готовое превью для ячейки
+    struct LoadedImage {
+        QImage image;
+        QImage thumbnail;
+        std::vector<QImage> mipChain;
+        int sourceSize = 0;
+    };
+
+    // Номер последней запущенной загрузки для каждой ячейки. Результат с
+    // другим номером устарел (ячейку перезаписали или сетку пересоздали).
+    std::map<std::pair<int,int>, quint64> pendingLoads;
+    quint64 loadSerial = 0;
+
+    struct LoadJob {
+        int row;
+        int col;
+        quint64 ticket;
+        QString path;
+        int maxSide;
+        int cellSize;
+        // Project cells: decode just enough for the thumbnail, the source
+        // itself waits for the export
+        bool thumbnailOnly = false;
+        // Фильтр экспорта: им уменьшаются BMP и TIFF, читаемые из файла напрямую
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+    };
+
+    // Functor for QtConcurrent::mapped, which wants result_type
+    struct LoadJobRunner {
+        using result_type = LoadedImage;
+        std::shared_ptr<DiskCache> diskCache;
+        LoadedImage operator()(const LoadJob& job) const {
+            return loadImage(job.path, job.maxSide, job.cellSize, diskCache.get(), job.filter);
+        }
+    };
+
+    // Decoded images wait here until the next flush puts them all into the
+    // grid in one pass
+    std::vector<std::pair<LoadJob, LoadedImage>> readyLoads;
+    QStringList failedLoads;
+    QTimer* flushLoadsTimer;
+
+    // Фоновое масштабирование превью после изменения размера ячеек
+    struct ThumbnailJob {
+        int row;
+        int col;
+        QString path;
+        QImage source;   // mip level, or the decoded square after eviction
+        bool needChain;  // the cache lost the entry, rebuild its levels too
+        int cellSize;
+    };
+
+    struct ScaledThumbnail {
+        QImage thumbnail;
+        std::vector<QImage> mipChain;
+    };
+
+    struct ThumbnailJobRunner {
+        using result_type = ScaledThumbnail;
+        ScaledThumbnail operator()(const ThumbnailJob& job) const {
+            StatsScope scope(Stats::Stage::Thumbnail, static_cast<qint64>(job.cellSize) * job.cellSize);
+            ScaledThumbnail result;
+            if (job.needChain) {
+                result.mipChain = ThumbnailCache::buildMipChain(job.source);
+            }
+            result.thumbnail = job.source.width() == job.cellSize
+                ? job.source
+                : Resampler::scaled(job.source, job.cellSize, job.cellSize);
+            return result;
+        }
+    };
+
+    // Cell size each path's background thumbnail is being scaled for, so a
+    // scroll doesn't queue it twice
+    std::map<QString, int> thumbnailRequests;
+
+    // Предпросмотр: сначала из превью ячеек в пределах кадра, потом
+    // уточняется из исходников с фильтром экспорта в фоне
+    static constexpr int previewSide = 512;
+    static constexpr int previewFrameMs = 8;
+    int previewTile = 0;
+    std::vector<int> previewQueue;        // cells to compose, row * gridSize + col
+    std::vector<char> previewQueued;
+    std::vector<quint64> previewSerials;  // a refine made for another serial is stale
+    quint64 previewSerial = 0;
+    QTimer* previewTimer;
+
+    struct PreviewJob {
+        int row;
+        int col;
+        quint64 serial;
+        QImage source;
+        int side;
+        Resampler::Filter filter;
+    };
+
+    struct PreviewJobRunner {
+        using result_type = QImage;
+        QImage operator()(const PreviewJob& job) const {
+            return previewTileFrom(job.source, job.side, job.filter);
+        }
+    };
     
     QWidget* centralWidget;
     QWidget* controlsContainer;
-    QWidget* dropContainer;
-    QGridLayout* gridLayout;
+    GridView* gridView;
     QLabel* titleLabel;
     QLabel* infoLabel;
     QSpinBox* sizeSpinBox;
+    QSpinBox* maxSizeSpinBox;
+    QComboBox* presetComboBox;
+    QComboBox* filterComboBox;
+    QCheckBox* gpuCheckBox;
+    QCheckBox* statsCheckBox;
+    QCheckBox* previewCheckBox;
+    PreviewView* previewView;
+    QLabel* statsLabel;
+    QTimer* statsTimer;
     QPushButton* clearButton;
+    QPushButton* openProjectButton;
+    QPushButton* saveProjectButton;
     QPushButton* createButton;
     
-    std::vector<std::vector<ImageCell*>> cells;
-    
-    QTimer* checkSizeTimer;
-    int lastWidth;
-    int lastHeight;
+    QTimer* relayoutTimer;
+    bool wideLayout = false;
 
     void setupUI() {
         setWindowTitle("Продвинутый Коллаж - C++ Qt5");
@@ -273,15 +702,67 @@ private:
         
         settingsLayout->addWidget(new QLabel("Размер сетки:"));
         sizeSpinBox = new QSpinBox();
-        sizeSpinBox->setRange(1, 10);
+        sizeSpinBox->setRange(1, 1000);
         sizeSpinBox->setValue(gridSize);
         connect(sizeSpinBox, QOverload<int>::of(&QSpinBox::valueChanged), 
                 this, &CollageApp::onGridSizeChanged);
         settingsLayout->addWidget(sizeSpinBox);
+
+        settingsLayout->addWidget(new QLabel("Макс. размер:"));
+        maxSizeSpinBox = new QSpinBox();
+        maxSizeSpinBox->setRange(500, 40000);
+        maxSizeSpinBox->setSingleStep(500);
+        maxSizeSpinBox->setSuffix(" px");
+        maxSizeSpinBox->setValue(maxCollageSize);
+        connect(maxSizeSpinBox, QOverload<int>::of(&QSpinBox::valueChanged),
+                this, &CollageApp::onMaxSizeChanged);
+        settingsLayout->addWidget(maxSizeSpinBox);
+
+        // Order matches CollageWorker::EncodePreset
+        settingsLayout->addWidget(new QLabel("Сжатие:"));
+        presetComboBox = new QComboBox();
+        presetComboBox->addItem("Быстро");
+        presetComboBox->addItem("Сбалансированно");
+        presetComboBox->addItem("Минимальный размер");
+        presetComboBox->setCurrentIndex(static_cast<int>(CollageWorker::EncodePreset::Balanced));
+        settingsLayout->addWidget(presetComboBox);
+
+        // Order matches Resampler::Filter
+        settingsLayout->addWidget(new QLabel("Фильтр:"));
+        filterComboBox = new QComboBox();
+        filterComboBox->addItem("Усреднение");
+        filterComboBox->addItem("Бикубический");
+        filterComboBox->addItem("Lanczos3");
+        filterComboBox->setCurrentIndex(static_cast<int>(Resampler::Filter::Lanczos3));
+        connect(filterComboBox, QOverload<int>::of(&QComboBox::currentIndexChanged),
+                this, &CollageApp::onFilterChanged);
+        settingsLayout->addWidget(filterComboBox);
+
+        gpuCheckBox = new QCheckBox("Видеокарта");
+        gpuCheckBox->setEnabled(glCompositor->isAvailable());
+        gpuCheckBox->setToolTip(glCompositor->isAvailable()
+                                ? "Собирать на видеокарте: быстрее, но мягче Lanczos3"
+                                : "OpenGL недоступен");
+        settingsLayout->addWidget(gpuCheckBox);
+
+        statsCheckBox = new QCheckBox("Статистика");
+        settingsLayout->addWidget(statsCheckBox);
+
+        previewCheckBox = new QCheckBox("Предпросмотр");
+        previewCheckBox->setChecked(true);
+        settingsLayout->addWidget(previewCheckBox);
         
         clearButton = new QPushButton("Очистить все");
         connect(clearButton, &QPushButton::clicked, this, &CollageApp::clearAll);
         settingsLayout->addWidget(clearButton);
+
+        openProjectButton = new QPushButton("Открыть проект");
+        connect(openProjectButton, &QPushButton::clicked, this, &CollageApp::openProject);
+        settingsLayout->addWidget(openProjectButton);
+
+        saveProjectButton = new QPushButton("Сохранить проект");
+        connect(saveProjectButton, &QPushButton::clicked, this, &CollageApp::saveProject);
+        settingsLayout->addWidget(saveProjectButton);
         
         settingsLayout->addStretch();
         controlsLayout->addWidget(settingsGroup);
@@ -292,6 +773,36 @@ private:
         infoLabel->setAlignment(Qt::AlignCenter);
         controlsLayout->addWidget(infoLabel);
 
+        // Stats panel: refreshed once a second, only while it is shown
+        statsLabel = new QLabel(controlsContainer);
+        statsLabel->setStyleSheet("QLabel { color: gray; font-family: monospace; }");
+        statsLabel->setVisible(false);
+        controlsLayout->addWidget(statsLabel);
+        statsTimer = new QTimer(this);
+        statsTimer->setInterval(1000);
+        connect(statsTimer, &QTimer::timeout, this, &CollageApp::updateStatsLabel);
+        connect(statsCheckBox, &QCheckBox::toggled, this, [this](bool shown) {
+            statsLabel->setVisible(shown);
+            if (shown) {
+                updateStatsLabel();
+                statsTimer->start();
+            } else {
+                statsTimer->stop();
+            }
+        });
+
+        // Preview pane: composed only while it is shown
+        previewView = new PreviewView(controlsContainer);
+        controlsLayout->addWidget(previewView);
+        connect(previewCheckBox, &QCheckBox::toggled, this, [this](bool shown) {
+            previewView->setVisible(shown);
+            if (shown) {
+                resetPreview();
+            } else {
+                previewTimer->stop();
+            }
+        });
+
         // Create button
         createButton = new QPushButton("Создать коллаж", controlsContainer);
         connect(createButton, &QPushButton::clicked, this, &CollageApp::createCollage);
@@ -299,15 +810,11 @@ private:
 
         controlsLayout->addStretch();
 
-        // Drop container with grid
-        dropContainer = new QWidget(centralWidget);
-        dropContainer->setStyleSheet("QWidget { background-color: #f0f0f0; border: 2px solid gray; }");
-        gridLayout = new QGridLayout(dropContainer);
-        gridLayout->setSpacing(2);
-        gridLayout->setContentsMargins(10, 10, 10, 10);
-
-        lastWidth = -1;
-        lastHeight = -1;
+        // The grid; cells are painted, not widgets
+        gridView = new GridView(centralWidget);
+        gridView->setCellSource([this](int row, int col) { return gridCell(row, col); });
+        connect(gridView, &GridView::filesDropped, this, &CollageApp::onFilesDropped);
+        connect(gridView, &GridView::visibleCellsChanged, this, &CollageApp::refreshThumbnails);
 
         updateLayout();
     }
@@ -318,179 +825,473 @@ private:
             delete centralWidget->layout();
         }
 
-        int windowWidth = width();
-        int windowHeight = height();
-
         QBoxLayout* mainLayout;
+        wideLayout = isWide();
 
-        if (windowWidth > windowHeight * 1.1) {
+        if (wideLayout) {
             // Wide window: controls on right, grid on left
             mainLayout = new QHBoxLayout(centralWidget);
-            mainLayout->addWidget(dropContainer, 1);
+            mainLayout->addWidget(gridView, 1);
             mainLayout->addWidget(controlsContainer, 0);
         } else {
             // Tall/square window: controls on top, grid on bottom
             mainLayout = new QVBoxLayout(centralWidget);
             mainLayout->addWidget(controlsContainer, 0);
-            mainLayout->addWidget(dropContainer, 1);
+            mainLayout->addWidget(gridView, 1);
         }
 
         mainLayout->setContentsMargins(10, 10, 10, 10);
     }
 
+    bool isWide() const {
+        return width() > height() * 1.1;
+    }
+
     void initializeGrid() {
-        lastWidth = width();
-        lastHeight = height();
         updateLayout();
         recreateGrid();
     }
-    
-    void checkWindowSize() {
-        int currentWidth = width();
-        int currentHeight = height();
-        
-        // Проверяем изменился ли размер ЗНАЧИТЕЛЬНО (минимум 50 пикселей)
-        int widthDiff = std::abs(lastWidth - currentWidth);
-        int heightDiff = std::abs(lastHeight - currentHeight);
-        
-        if (widthDiff > 50 || heightDiff > 50) {
-            lastWidth = currentWidth;
-            lastHeight = currentHeight;
-            
-            // Обновляем только layout (без пересоздания сетки)
+
+    void resizeEvent(QResizeEvent* event) override {
+        QMainWindow::resizeEvent(event);
+        relayoutTimer->start();
+    }
+
+    // The layout is rebuilt only when the window crosses the wide/tall
+    // threshold; otherwise the cells are just resized
+    void applyWindowSize() {
+        if (isWide() != wideLayout) {
             updateLayout();
-            
-            // Пересчитываем размер ячеек и меняем их размер (без пересоздания)
-            resizeCells();
+            // The new layout gives the grid its size on the next pass
+            QTimer::singleShot(0, this, &CollageApp::resizeCells);
+            return;
         }
+        resizeCells();
     }
     
     void resizeCells() {
-        if (cells.empty()) return;
-        
-        // Calculate new cell size
-        int availableWidth = dropContainer->width() - 20;
-        int availableHeight = dropContainer->height() - 20;
-        
-        if (availableWidth <= 1 || availableHeight <= 1) {
-            return;
+        // Old thumbnails are stretched until the rescaled ones arrive
+        if (gridView->fitCells()) {
+            refreshThumbnails();
         }
+    }
 
-        int cellSize = std::min(availableWidth / gridSize, availableHeight / gridSize);
-        cellSize = std::max(cellSize, 50);
+    void recreateGrid() {
+        pendingLoads.clear();
+        gridView->setGridSize(gridSize);
+        gridView->fitCells();
+        refreshThumbnails();
+        resetPreview();
+        updateInfoLabel();
+    }
 
-        // Просто меняем размер существующих ячеек
-        for (int i = 0; i < gridSize; i++) {
-            for (int j = 0; j < gridSize; j++) {
-                cells[static_cast<size_t>(i)][static_cast<size_t>(j)]->setFixedSize(cellSize, cellSize);
+    // Pending loads of cells outside the new bounds are dropped; decoded
+    // images and thumbnails of the cells that stay are kept
+    void resizeGrid(int newSize) {
+        for (auto it = pendingLoads.begin(); it != pendingLoads.end();) {
+            if (it->first.first >= newSize || it->first.second >= newSize) {
+                it = pendingLoads.erase(it);
+            } else {
+                ++it;
             }
         }
-        
-        // Обновляем превью
-        updateAllThumbnails(cellSize);
+        gridView->setGridSize(newSize);
+        resetPreview();
     }
 
-    void recreateGrid() {
-        // Clear existing grid
-        while (gridLayout->count() > 0) {
-            QLayoutItem* item = gridLayout->takeAt(0);
-            if (item->widget()) {
-                delete item->widget();
+    // What the grid paints for a cell: state and whatever thumbnail the
+    // cache has for it, at any size
+    GridView::Cell gridCell(int row, int col) {
+        GridView::Cell cell;
+        const ImageStore::Handle& data = images.at(row, col);
+        if (data) {
+            cell.state = GridView::CellState::Loaded;
+            cell.path = data->path;
+            cell.thumbnail = thumbnailCache.pixmap(data->path);
+        }
+        if (pendingLoads.count({row, col})) {
+            cell.state = GridView::CellState::Loading;
+        }
+        return cell;
+    }
+
+    static bool isImageFile(const QFileInfo& fileInfo) {
+        static const QStringList validExtensions = {"jpg", "jpeg", "png", "bmp", "gif", "tiff", "webp"};
+        return validExtensions.contains(fileInfo.suffix().toLower());
+    }
+
+    // Files are placed row by row starting at the cell they were dropped
+    // on; a folder stands for the images directly inside it, sorted by name
+    void onFilesDropped(int row, int col, const QStringList& paths) {
+        QStringList files;
+        bool skipped = false;
+        for (const QString& path : paths) {
+            QFileInfo fileInfo(path);
+            if (fileInfo.isDir()) {
+                for (const QFileInfo& entry : QDir(path).entryInfoList(QDir::Files, QDir::Name)) {
+                    if (isImageFile(entry)) {
+                        files.append(entry.filePath());
+                    }
+                }
+            } else if (isImageFile(fileInfo)) {
+                files.append(path);
+            } else {
+                skipped = true;
             }
-            delete item;
         }
-        cells.clear();
 
-        // Calculate cell size - адаптивный по размеру окна
-        int availableWidth = dropContainer->width() - 20;
-        int availableHeight = dropContainer->height() - 20;
-        
-        if (availableWidth <= 1 || availableHeight <= 1) {
-            availableWidth = 400;
-            availableHeight = 400;
-        }
-
-        int cellSize = std::min(availableWidth / gridSize, availableHeight / gridSize);
-        cellSize = std::max(cellSize, 50); // Minimum cell size
-
-        // Create grid cells
-        cells.resize(static_cast<size_t>(gridSize));
-        for (int i = 0; i < gridSize; i++) {
-            cells[static_cast<size_t>(i)].resize(static_cast<size_t>(gridSize));
-            for (int j = 0; j < gridSize; j++) {
-                ImageCell* cell = new ImageCell(i, j, dropContainer);
-                cell->setFixedSize(cellSize, cellSize);
-                cell->setScaledContents(true);
-                
-                connect(cell, &ImageCell::imageDropped, this, &CollageApp::onImageDropped);
-                
-                gridLayout->addWidget(cell, i, j);
-                cells[static_cast<size_t>(i)][static_cast<size_t>(j)] = cell;
+        if (files.isEmpty()) {
+            QMessageBox::warning(this, "Предупреждение", skipped && paths.size() == 1
+                                 ? "Выбранный файл не является изображением"
+                                 : "Среди перетащенных файлов нет изображений");
+            return;
+        }
+
+        std::vector<LoadJob> jobs;
+        const int first = row * gridSize + col;
+        const int count = std::min(static_cast<int>(files.size()), gridSize * gridSize - first);
+        const bool streamed = streamedExport();
+        for (int i = 0; i < count; i++) {
+            const int cellRow = (first + i) / gridSize;
+            const int cellCol = (first + i) % gridSize;
+            if (streamed) {
+                // Like a project cell: a placeholder the thumbnail load fills in
+                images.set(cellRow, cellCol, {files[i], QImage(), 0});
+                jobs.push_back(makeThumbnailJob(cellRow, cellCol, files[i]));
+            } else {
+                jobs.push_back(makeLoadJob(cellRow, cellCol, files[i]));
             }
         }
+        startLoads(std::move(jobs));
 
-        // Restore images
-        updateAllThumbnails(cellSize);
-        updateInfoLabel();
+        if (count < files.size()) {
+            // The batch keeps loading behind the message
+            QMessageBox::information(this, "Информация",
+                                     QString("Не поместилось в сетку файлов: %1").arg(files.size() - count));
+        }
     }
 
-    void onImageDropped(int row, int col, QString filePath) {
-        QStringList validExtensions = {"jpg", "jpeg", "png", "bmp", "gif", "tiff", "webp"};
-        QFileInfo fileInfo(filePath);
-        
-        if (!validExtensions.contains(fileInfo.suffix().toLower())) {
-            QMessageBox::warning(this, "Предупреждение", "Выбранный файл не является изображением");
-            return;
+    // A collage the worker writes band by band. Its sources aren't kept
+    // decoded here: the squares alone would take about as much memory as
+    // the whole collage, while the export decodes them one band at a time.
+    bool streamedExport() const {
+        const int side = std::max(1, maxCollageSize / gridSize);
+        return CollageWorker::isStreamed(CollageWorker::planLayout(gridSize, gridSize, maxCollageSize, QSize(), side),
+                                         "png");
+    }
+
+    // Больше тайла, чем maxCollageSize / gridSize, коллажу не понадобится
+    int decodeSize(int cellSize) const {
+        return std::max(maxCollageSize / gridSize, cellSize);
+    }
+
+    LoadJob makeLoadJob(int row, int col, const QString& filePath) const {
+        int cellSize = gridView->cellSize();
+        return {row, col, 0, filePath, decodeSize(cellSize), cellSize, false, currentFilter()};
+    }
+
+    LoadJob makeThumbnailJob(int row, int col, const QString& filePath) const {
+        int cellSize = gridView->cellSize();
+        return {row, col, 0, filePath, cellSize, cellSize, true, currentFilter()};
+    }
+
+    Resampler::Filter currentFilter() const {
+        return static_cast<Resampler::Filter>(filterComboBox->currentIndex());
+    }
+
+    // Decodes the whole batch on the thread pool, visible cells first; the
+    // cells show "loading" meanwhile
+    void startLoads(std::vector<LoadJob> jobs) {
+        if (jobs.empty()) return;
+        for (LoadJob& job : jobs) {
+            job.ticket = ++loadSerial;
+            pendingLoads[{job.row, job.col}] = job.ticket;
+            gridView->updateCell(job.row, job.col);
         }
+        std::stable_partition(jobs.begin(), jobs.end(), [this](const LoadJob& job) {
+            return gridView->isCellVisible(job.row, job.col);
+        });
+
+        auto* watcher = new QFutureWatcher<LoadedImage>(this);
+        connect(watcher, &QFutureWatcher<LoadedImage>::resultReadyAt, this, [=](int index) {
+            readyLoads.emplace_back(jobs[static_cast<size_t>(index)], watcher->resultAt(index));
+            if (!flushLoadsTimer->isActive()) {
+                flushLoadsTimer->start();
+            }
+        });
+        connect(watcher, &QFutureWatcher<LoadedImage>::finished, this, [=]() {
+            flushLoadsTimer->stop();
+            flushLoadedImages();
+            watcher->deleteLater();
+            if (!failedLoads.isEmpty()) {
+                QStringList names = failedLoads;
+                failedLoads.clear();
+                QMessageBox::critical(this, "Ошибка", names.size() == 1
+                                      ? "Не удалось загрузить изображение"
+                                      : QString("Не удалось загрузить изображения:\n%1").arg(names.join("\n")));
+            }
+        });
+        watcher->setFuture(QtConcurrent::mapped(jobs, LoadJobRunner{diskCache}));
+    }
+
+    // Runs on a pool thread: must not touch widgets or members
+    static LoadedImage loadImage(const QString& filePath, int maxSide, int cellSize, DiskCache* diskCache,
+                                 Resampler::Filter filter) {
+        LoadedImage result;
+        result.image = CollageWorker::loadCenterSquare(filePath, maxSide, &result.sourceSize, diskCache, filter);
+        if (!result.image.isNull()) {
+            StatsScope scope(Stats::Stage::Thumbnail, static_cast<qint64>(cellSize) * cellSize);
+            result.mipChain = ThumbnailCache::buildMipChain(result.image);
+            result.thumbnail = Resampler::scaled(result.image, cellSize, cellSize);
+        }
+        return result;
+    }
 
-        QImage image(filePath);
-        if (image.isNull()) {
-            QMessageBox::critical(this, "Ошибка", "Не удалось загрузить изображение");
+    // Puts everything decoded since the last flush into the grid with one
+    // repaint
+    void flushLoadedImages() {
+        if (readyLoads.empty()) return;
+        for (const auto& ready : readyLoads) {
+            onImageLoaded(ready.first, ready.second);
+        }
+        readyLoads.clear();
+        updateInfoLabel();
+        // Cells resized while these were decoding
+        refreshThumbnails();
+    }
+
+    void onImageLoaded(const LoadJob& job, const LoadedImage& loaded) {
+        auto pending = pendingLoads.find({job.row, job.col});
+        if (pending == pendingLoads.end() || pending->second != job.ticket) {
+            return; // stale result
+        }
+        pendingLoads.erase(pending);
+        gridView->updateCell(job.row, job.col);
+
+        if (loaded.image.isNull()) {
+            failedLoads.append(QFileInfo(job.path).fileName());
+            if (job.thumbnailOnly) {
+                images.remove(job.row, job.col); // the export would fail on it
+                invalidatePreview(job.row, job.col);
+            }
             return;
         }
 
         // Store image data
-        imageData[{row, col}] = {filePath, image};
-
-        // Create and display thumbnail
-        int cellSize = cells[static_cast<size_t>(row)][static_cast<size_t>(col)]->width();
-        QImage squared = cropCenterToSquare(image);
-        QPixmap thumbnail = QPixmap::fromImage(squared.scaled(cellSize, cellSize, 
-                                                              Qt::IgnoreAspectRatio, 
-                                                              Qt::SmoothTransformation));
-        
-        cells[static_cast<size_t>(row)][static_cast<size_t>(col)]->setImageData(thumbnail, fileInfo.fileName());
-        updateInfoLabel();
+        if (!job.thumbnailOnly) {
+            // Max size may have grown past a streamed export since the load began
+            images.set(job.row, job.col, {job.path, streamedExport() ? QImage() : loaded.image, loaded.sourceSize});
+        } else if (!images.at(job.row, job.col)) {
+            return; // cell emptied meanwhile
+        } else if (images.at(job.row, job.col)->sourceSize <= 0) {
+            images.set(job.row, job.col, {job.path, QImage(), loaded.sourceSize});
+        }
+        thumbnailCache.insert(job.path, loaded.mipChain, loaded.thumbnail);
+        invalidatePreview(job.row, job.col);
     }
 
-    void updateAllThumbnails(int cellSize) {
-        for (const auto& pair : imageData) {
-            int row = pair.first.first;
-            int col = pair.first.second;
-            
-            if (row < gridSize && col < gridSize) {
-                QImage squared = cropCenterToSquare(pair.second.image);
-                QPixmap thumbnail = QPixmap::fromImage(squared.scaled(cellSize, cellSize,
-                                                                      Qt::IgnoreAspectRatio,
-                                                                      Qt::SmoothTransformation));
-                QFileInfo fileInfo(pair.second.path);
-                cells[static_cast<size_t>(row)][static_cast<size_t>(col)]->setImageData(thumbnail, fileInfo.fileName());
+    // Starts the preview over, for a new grid or filter: white, with every
+    // filled cell queued
+    void resetPreview() {
+        previewTile = std::max(1, previewSide / gridSize);
+        const int side = previewTile * gridSize;
+        QImage& canvas = previewView->canvas();
+        if (canvas.width() != side) {
+            canvas = QImage(side, side, QImage::Format_RGB32);
+        }
+        canvas.fill(Qt::white);
+        const size_t cells = static_cast<size_t>(gridSize) * gridSize;
+        previewQueue.clear();
+        previewQueued.assign(cells, 0);
+        previewSerials.assign(cells, 0);
+        images.forEach([this](int row, int col, const CollageWorker::ImageData&) {
+            invalidatePreview(row, col);
+        });
+        previewView->update();
+    }
+
+    // The cell changed: compose it again, and drop refines still running
+    // for its old contents
+    void invalidatePreview(int row, int col) {
+        if (row < 0 || col < 0 || row >= gridSize || col >= gridSize) return;
+        const size_t cell = static_cast<size_t>(row) * gridSize + col;
+        if (cell >= previewSerials.size()) return;
+        previewSerials[cell] = ++previewSerial;
+        if (!previewQueued[cell]) {
+            previewQueued[cell] = 1;
+            previewQueue.push_back(static_cast<int>(cell));
+        }
+        if (previewCheckBox->isChecked() && !previewTimer->isActive()) {
+            previewTimer->start();
+        }
+    }
+
+    // A writable view of the cell in the preview canvas
+    QImage previewCell(int row, int col) {
+        QImage& canvas = previewView->canvas();
+        uchar* origin = canvas.bits() + static_cast<size_t>(row) * previewTile * canvas.bytesPerLine()
+                                      + static_cast<size_t>(col) * previewTile * 4;
+        return QImage(origin, previewTile, previewTile, canvas.bytesPerLine(), QImage::Format_RGB32);
+    }
+
+    // Runs on a pool thread as well: the center square of source at side
+    static QImage previewTileFrom(const QImage& source, int side, Resampler::Filter filter) {
+        QImage tile = PixelPool::instance().image(side, side, QImage::Format_RGB32);
+        Resampler::resample(source, Resampler::centerRect(source.size(), tile.size()), tile, filter);
+        return tile;
+    }
+
+    // Composes queued cells from the thumbnail cache's mip levels until the
+    // frame budget is spent, the rest on the next tick. Cells with a decoded
+    // source are then refined from it on the thread pool, with the export's
+    // filter, the way the export itself will make their tiles.
+    void composePreview() {
+        QElapsedTimer frame;
+        frame.start();
+        const Resampler::Filter filter = static_cast<Resampler::Filter>(filterComboBox->currentIndex());
+        std::vector<PreviewJob> refines;
+        size_t done = 0;
+        while (done < previewQueue.size() && frame.elapsed() < previewFrameMs) {
+            const int cell = previewQueue[done++];
+            previewQueued[static_cast<size_t>(cell)] = 0;
+            const int row = cell / gridSize;
+            const int col = cell % gridSize;
+            QImage dest = previewCell(row, col);
+            const ImageStore::Handle& data = images.at(row, col);
+            const QImage level = data ? thumbnailCache.sourceLevel(data->path, previewTile) : QImage();
+            if (!level.isNull()) {
+                Resampler::resample(level, Resampler::centerRect(level.size(), dest.size()), dest,
+                                    Resampler::Filter::Box);
+            } else {
+                dest.fill(data ? QColor("lightgray") : QColor(Qt::white));
+            }
+            if (data && !data->image.isNull()) {
+                refines.push_back({row, col, previewSerials[static_cast<size_t>(cell)], data->image,
+                                   previewTile, filter});
             }
         }
+        previewQueue.erase(previewQueue.begin(), previewQueue.begin() + static_cast<std::ptrdiff_t>(done));
+        previewView->update();
+        if (!previewQueue.empty()) {
+            previewTimer->start();
+        }
+        if (refines.empty()) return;
+
+        auto* watcher = new QFutureWatcher<QImage>(this);
+        connect(watcher, &QFutureWatcher<QImage>::resultReadyAt, this, [=](int index) {
+            const PreviewJob& job = refines[static_cast<size_t>(index)];
+            const size_t cell = static_cast<size_t>(job.row) * gridSize + job.col;
+            if (job.side != previewTile || cell >= previewSerials.size() || previewSerials[cell] != job.serial) {
+                return; // the cell, the grid or the filter changed meanwhile
+            }
+            const QImage tile = watcher->resultAt(index);
+            QImage dest = previewCell(job.row, job.col);
+            for (int y = 0; y < dest.height(); y++) {
+                memcpy(dest.scanLine(y), tile.constScanLine(y), static_cast<size_t>(dest.width()) * 4);
+            }
+            previewView->update();
+        });
+        connect(watcher, &QFutureWatcher<QImage>::finished, watcher, &QObject::deleteLater);
+        watcher->setFuture(QtConcurrent::mapped(refines, PreviewJobRunner()));
     }
 
-    QImage cropCenterToSquare(const QImage& img) {
-        int width = img.width();
-        int height = img.height();
-        int newSize = std::min(width, height);
-        int left = (width - newSize) / 2;
-        int top = (height - newSize) / 2;
-        return img.copy(left, top, newSize, newSize);
+    // Visible cells whose thumbnail is missing or of another size get one
+    // scaled on the thread pool, or decoded for project cells the cache lost;
+    // the rest wait until they are scrolled into view. A cell with an exact
+    // mip level is updated at once.
+    void refreshThumbnails() {
+        const int cellSize = gridView->cellSize();
+        std::vector<ThumbnailJob> jobs;
+        std::vector<LoadJob> thumbnailLoads;
+        gridView->forEachVisibleCell([&](int row, int col) {
+            const ImageStore::Handle& data = images.at(row, col);
+            if (!data || pendingLoads.count({row, col}) || thumbnailCache.hasThumbnail(data->path, cellSize)) {
+                return;
+            }
+            auto requested = thumbnailRequests.find(data->path);
+            if (requested != thumbnailRequests.end() && requested->second == cellSize) {
+                return; // on its way
+            }
+            QImage level = thumbnailCache.sourceLevel(data->path, cellSize);
+            if (level.isNull() && data->image.isNull()) {
+                thumbnailLoads.push_back(makeThumbnailJob(row, col, data->path));
+            } else if (level.width() == cellSize) {
+                thumbnailCache.thumbnail(data->path, cellSize);
+                gridView->updateCell(row, col);
+            } else {
+                jobs.push_back({row, col, data->path, level.isNull() ? data->image : level, level.isNull(), cellSize});
+                thumbnailRequests[data->path] = cellSize;
+            }
+        });
+        startLoads(std::move(thumbnailLoads));
+        if (jobs.empty()) return;
+
+        auto* watcher = new QFutureWatcher<ScaledThumbnail>(this);
+        connect(watcher, &QFutureWatcher<ScaledThumbnail>::resultReadyAt, this, [=](int index) {
+            const ThumbnailJob& job = jobs[static_cast<size_t>(index)];
+            auto requested = thumbnailRequests.find(job.path);
+            if (requested != thumbnailRequests.end() && requested->second == job.cellSize) {
+                thumbnailRequests.erase(requested);
+            }
+            if (job.cellSize != gridView->cellSize()) return; // cells resized again
+            const ImageStore::Handle data = images.at(job.row, job.col);
+            if (!data || data->path != job.path || pendingLoads.count({job.row, job.col})) {
+                return; // cell was cleared or refilled meanwhile
+            }
+            ScaledThumbnail scaled = watcher->resultAt(index);
+            if (job.needChain) {
+                thumbnailCache.insert(job.path, std::move(scaled.mipChain), scaled.thumbnail);
+            } else {
+                thumbnailCache.setThumbnail(job.path, scaled.thumbnail);
+            }
+            // Other cells may show the same file
+            gridView->viewport()->update();
+        });
+        connect(watcher, &QFutureWatcher<ScaledThumbnail>::finished, watcher, &QObject::deleteLater);
+        watcher->setFuture(QtConcurrent::mapped(jobs, ThumbnailJobRunner()));
+    }
+
+    // Throughput of each stage over the session, then cache hit rates and
+    // memory
+    void updateStatsLabel() {
+        const Stats& stats = Stats::instance();
+        auto rate = [](int percent) {
+            return percent < 0 ? QString("—") : QString("%1%").arg(percent);
+        };
+        QStringList lines;
+        for (Stats::Stage stage : {Stats::Stage::Decode, Stats::Stage::Thumbnail, Stats::Stage::Resample,
+                                   Stats::Stage::Paint, Stats::Stage::GpuCompose, Stats::Stage::Encode,
+                                   Stats::Stage::Save}) {
+            const Stats::Totals totals = stats.totals(stage);
+            if (totals.calls == 0) continue;
+            const double seconds = totals.nanos / 1e9;
+            QString line = QString("%1: %2 × %3 с").arg(Stats::stageName(stage), -12)
+                               .arg(totals.calls).arg(seconds, 0, 'f', 2);
+            if (totals.pixels > 0 && seconds > 0) {
+                line += QString(", %1 МП/с").arg(totals.pixels / 1e6 / seconds, 0, 'f', 1);
+            }
+            if (totals.bytes > 0 && seconds > 0) {
+                line += QString(", %1 МБ/с").arg(totals.bytes / 1048576.0 / seconds, 0, 'f', 1);
+            }
+            lines << line;
+        }
+        lines << QString("Кэш: тайлы %1, полосы %2, превью %3, диск %4, буферы %5")
+                     .arg(rate(stats.hitRate(Stats::Counter::TileHit, Stats::Counter::TileMiss)))
+                     .arg(rate(stats.hitRate(Stats::Counter::BandHit, Stats::Counter::BandMiss)))
+                     .arg(rate(stats.hitRate(Stats::Counter::ThumbnailHit, Stats::Counter::ThumbnailMiss)))
+                     .arg(rate(stats.hitRate(Stats::Counter::DiskHit, Stats::Counter::DiskMiss)))
+                     .arg(rate(stats.hitRate(Stats::Counter::PoolHit, Stats::Counter::PoolMiss)));
+        lines << QString("Память: рендер %1 МБ, превью %2 МБ, буферы %3 МБ (свободно %4 МБ)")
+                     .arg(renderCache->memoryUsage() / 1048576)
+                     .arg(thumbnailCache.memoryUsage() / 1048576)
+                     .arg(PixelPool::instance().inUse() / 1048576)
+                     .arg(PixelPool::instance().retained() / 1048576);
+        statsLabel->setText(lines.join("\n"));
     }
 
     void updateInfoLabel() {
         int totalCells = gridSize * gridSize;
-        int filledCells = static_cast<int>(imageData.size());
+        int filledCells = images.count();
         infoLabel->setText(QString("Заполнено %1 из %2 ячеек").arg(filledCells).arg(totalCells));
         
         if (filledCells == totalCells) {
@@ -502,45 +1303,189 @@ private:
 
     void onGridSizeChanged(int newSize) {
         if (newSize != gridSize) {
-            // Save current images
-            auto oldData = imageData;
-            
             // Update size
             gridSize = newSize;
-            imageData.clear();
-            
-            // Recreate grid
-            updateLayout();
-            recreateGrid();
-            
-            // Restore images that fit in new grid
-            for (const auto& pair : oldData) {
-                int row = pair.first.first;
-                int col = pair.first.second;
-                if (row < newSize && col < newSize) {
-                    onImageDropped(row, col, pair.second.path);
-                }
+
+            // Forget images that no longer fit, keep the rest as decoded
+            images.resize(newSize);
+
+            resizeGrid(newSize);
+            resizeCells();
+            updateInfoLabel();
+
+            // A smaller grid needs bigger tiles
+            redecodeUndersized();
+        }
+    }
+
+    void onMaxSizeChanged(int newSize) {
+        maxCollageSize = newSize;
+        redecodeUndersized();
+    }
+
+    // Декодированные BMP и TIFF уменьшены прежним фильтром: читаем их заново
+    void onFilterChanged() {
+        resetPreview();
+        std::vector<LoadJob> jobs;
+        images.forEach([&](int row, int col, const CollageWorker::ImageData& data) {
+            if (!data.image.isNull() && MappedImage::mayMap(data.path)) {
+                jobs.push_back(makeLoadJob(row, col, data.path));
             }
+        });
+        startLoads(std::move(jobs));
+    }
+
+    // Re-read from disk only the images decoded smaller than the current
+    // grid and maximum size can use
+    void redecodeUndersized() {
+        if (streamedExport()) {
+            releaseDecodedSources();
+            return;
+        }
+        std::vector<LoadJob> jobs;
+        const int cellSize = gridView->cellSize();
+        images.forEach([&](int row, int col, const CollageWorker::ImageData& data) {
+            // Undecoded project cells are left to the export
+            if (!data.image.isNull() && data.image.width() < std::min(data.sourceSize, decodeSize(cellSize))) {
+                jobs.push_back(makeLoadJob(row, col, data.path));
+            }
+        });
+        startLoads(std::move(jobs));
+    }
+
+    // Keeps path and size of every cell, the thumbnails stay in their cache
+    void releaseDecodedSources() {
+        std::vector<std::pair<int, int>> decoded;
+        images.forEach([&](int row, int col, const CollageWorker::ImageData& data) {
+            if (!data.image.isNull()) {
+                decoded.push_back({row, col});
+            }
+        });
+        for (const auto& cell : decoded) {
+            const ImageStore::Handle data = images.at(cell.first, cell.second);
+            images.set(cell.first, cell.second, {data->path, QImage(), data->sourceSize});
         }
     }
 
     void clearAll() {
-        imageData.clear();
+        images = ImageStore(gridSize);
+        renderCache->clear();
         updateLayout();
         recreateGrid();
     }
 
+    // Grid, settings and cell paths as a JSON manifest that --batch can
+    // render as well. Each cell also records its source size and the disk
+    // cache key of the square an export decodes, which tells on opening
+    // whether the source changed since.
+    void saveProject() {
+        if (images.empty()) {
+            QMessageBox::warning(this, "Предупреждение", "Добавьте хотя бы одно изображение!");
+            return;
+        }
+        QString path = QFileDialog::getSaveFileName(this, "Сохранить проект", "", "Проект коллажа (*.json)");
+        if (path.isEmpty()) {
+            return;
+        }
+        if (QFileInfo(path).suffix().isEmpty()) {
+            path += ".json";
+        }
+
+        BatchRunner::Job project;
+        project.rows = project.cols = gridSize;
+        project.maxSize = maxCollageSize;
+        project.preset = CollageWorker::presetName(static_cast<CollageWorker::EncodePreset>(presetComboBox->currentIndex()));
+        project.filter = Resampler::filterName(static_cast<Resampler::Filter>(filterComboBox->currentIndex()));
+        const int exportSide = std::max(1, maxCollageSize / gridSize);
+        images.forEach([&](int row, int col, const CollageWorker::ImageData& data) {
+            project.cells.push_back({row, col, data.path, data.sourceSize,
+                                     CollageWorker::squareKey(data.path, exportSide, currentFilter())});
+        });
+
+        QString error;
+        if (!BatchRunner::writeManifest(project, path, &error)) {
+            QMessageBox::critical(this, "Ошибка", QString("Не удалось сохранить проект:\n%1").arg(error));
+        }
+    }
+
+    // Opens a project without decoding the sources: cells get placeholders
+    // and small thumbnail decodes, visible cells first, and the sources are
+    // decoded by the export only where no cached tile covers them
+    void openProject() {
+        QString path = QFileDialog::getOpenFileName(this, "Открыть проект", "",
+                                                    "Проект коллажа (*.json);;CSV (*.csv);;Все файлы (*.*)");
+        if (path.isEmpty()) {
+            return;
+        }
+        BatchRunner::Job project;
+        project.manifestPath = path;
+        QString error;
+        bool opened = BatchRunner::readManifest(project, &error) && BatchRunner::resolveJob(project, &error);
+        if (opened && (project.rows != project.cols || project.width > 0)) {
+            // Окно показывает только квадратную сетку с размером по maxSize
+            error = QString("Сетка %1x%2 или заданный размер коллажа поддерживаются только в режиме --batch")
+                        .arg(project.rows).arg(project.cols);
+            opened = false;
+        }
+        if (opened && project.rows > sizeSpinBox->maximum()) {
+            error = QString("Сетка %1x%1 больше допустимой").arg(project.rows);
+            opened = false;
+        }
+        if (!opened) {
+            QMessageBox::critical(this, "Ошибка", QString("Не удалось открыть проект:\n%1").arg(error));
+            return;
+        }
+
+        {
+            QSignalBlocker gridBlocker(sizeSpinBox);
+            QSignalBlocker maxSizeBlocker(maxSizeSpinBox);
+            sizeSpinBox->setValue(project.rows);
+            maxSizeSpinBox->setValue(project.maxSize);
+        }
+        gridSize = project.rows;
+        maxCollageSize = maxSizeSpinBox->value();
+        presetComboBox->setCurrentIndex(static_cast<int>(CollageWorker::presetFromName(project.preset)));
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+        Resampler::filterFromName(project.filter, &filter);
+        {
+            QSignalBlocker filterBlocker(filterComboBox); // recreateGrid reloads everything
+            filterComboBox->setCurrentIndex(static_cast<int>(filter));
+        }
+
+        images = ImageStore(gridSize);
+        recreateGrid();
+
+        const int exportSide = std::max(1, maxCollageSize / gridSize);
+        std::vector<LoadJob> jobs;
+        for (const BatchRunner::Cell& cell : project.cells) {
+            // A changed source gets a different key, its saved size is stale
+            const bool unchanged = !cell.key.isEmpty() && cell.key == CollageWorker::squareKey(cell.path, exportSide, filter);
+            images.set(cell.row, cell.col, {cell.path, QImage(), unchanged ? cell.sourceSize : 0});
+            jobs.push_back(makeThumbnailJob(cell.row, cell.col, cell.path));
+        }
+        startLoads(std::move(jobs));
+        updateInfoLabel();
+    }
+
     void createCollage() {
-        if (imageData.empty()) {
+        if (images.empty()) {
             QMessageBox::warning(this, "Предупреждение", "Добавьте хотя бы одно изображение!");
             return;
         }
 
+        QString selectedFilter;
         QString outputPath = QFileDialog::getSaveFileName(this, "Сохранить коллаж как", 
-                                                          "", "PNG (*.png);;JPEG (*.jpg);;Все файлы (*.*)");
+                                                          "", "PNG (*.png);;JPEG (*.jpg);;Все файлы (*.*)",
+                                                          &selectedFilter);
         if (outputPath.isEmpty()) {
             return;
         }
+        if (QFileInfo(outputPath).suffix().isEmpty()) {
+            outputPath += selectedFilter.startsWith("JPEG") ? ".jpg" : ".png";
+        }
+        CollageWorker::EncodeOptions encodeOptions = CollageWorker::encodeOptions(
+            static_cast<CollageWorker::EncodePreset>(presetComboBox->currentIndex()),
+            CollageWorker::formatForPath(outputPath, selectedFilter));
 
         // Create progress dialog
         QProgressDialog* progressDialog = new QProgressDialog("Создание коллажа...", "Отмена", 0, 100, this);
@@ -548,35 +1493,78 @@ private:
         progressDialog->setMinimumDuration(0);
         progressDialog->setValue(0);
 
-        // Create worker and thread
-        QThread* thread = new QThread;
-        CollageWorker* worker = new CollageWorker(imageData, gridSize, maxCollageSize, outputPath);
-        worker->moveToThread(thread);
+        // Create worker, it runs on the export pool
+        auto cancelToken = std::make_shared<std::atomic<bool>>(false);
+        CollageWorker* worker = new CollageWorker(images, maxCollageSize, outputPath,
+                                                  encodeOptions, cancelToken);
+        worker->setFilter(static_cast<Resampler::Filter>(filterComboBox->currentIndex()));
+        worker->setRenderCache(renderCache);
+        worker->setDiskCache(diskCache);
+        if (gpuCheckBox->isChecked()) {
+            worker->setCompositor(glCompositor);
+        }
 
-        connect(thread, &QThread::started, worker, &CollageWorker::process);
-        connect(worker, &CollageWorker::progress, progressDialog, &QProgressDialog::setValue);
+        connect(worker, &CollageWorker::progress, progressDialog, [=](int value) {
+            if (!cancelToken->load()) {
+                progressDialog->setValue(value);
+            }
+        });
+        connect(worker, &CollageWorker::tileProgress, progressDialog,
+                [=](int tiles, int tilesTotal, qint64 pixels, qint64 bytes) {
+            progressDialog->setLabelText(QString("Создание коллажа... %1 из %2 тайлов, %3 МП, записано %4 МБ")
+                                         .arg(tiles).arg(tilesTotal)
+                                         .arg(pixels / 1e6, 0, 'f', 1)
+                                         .arg(bytes / 1048576.0, 0, 'f', 1));
+        });
         connect(worker, &CollageWorker::finished, this, [=](bool success, QString message) {
             progressDialog->close();
-            if (success) {
-                QMessageBox::information(this, "Успех", message);
-            } else {
-                QMessageBox::critical(this, "Ошибка", message);
+            progressDialog->deleteLater();
+            // A cancelled job was already dismissed by the user, nothing to report
+            if (!cancelToken->load()) {
+                if (success) {
+                    QMessageBox::information(this, "Успех", message);
+                } else {
+                    QMessageBox::critical(this, "Ошибка", message);
+                }
             }
-            thread->quit();
         });
-        connect(thread, &QThread::finished, worker, &QObject::deleteLater);
-        connect(thread, &QThread::finished, thread, &QObject::deleteLater);
-        connect(progressDialog, &QProgressDialog::canceled, thread, &QThread::quit);
+        // process() notices the flag at its next checkpoint and returns early
+        connect(progressDialog, &QProgressDialog::canceled, this, [=]() {
+            cancelToken->store(true);
+        });
 
-        thread->start();
+        // The worker stays owned by the GUI thread, its signals are queued
+        // here and deleteLater() runs after finished has been delivered
+        QtConcurrent::run(&exportPool, [worker]() {
+            worker->process();
+            worker->deleteLater();
+        });
     }
 };
 
 int main(int argc, char *argv[]) {
+    // --batch: manifests only, no window and no display connection
+    // --serve: the same, as a render service on a local socket
+    for (int i = 1; i < argc; i++) {
+        if (qstrcmp(argv[i], "--batch") == 0) {
+            QCoreApplication app(argc, argv);
+            int status = BatchRunner().run(app.arguments());
+            Stats::instance().writeTrace();
+            return status;
+        }
+        if (qstrcmp(argv[i], "--serve") == 0) {
+            QCoreApplication app(argc, argv);
+            return RenderServer::run(app);
+        }
+    }
+
     QApplication app(argc, argv);
     CollageApp window;
     window.show();
-    return app.exec();
+    int status = app.exec();
+    // COLLAGE_TRACE=<file>: the whole session as a Chrome trace
+    Stats::instance().writeTrace();
+    return status;
 }
 
 #include "main.moc"
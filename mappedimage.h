@@ -0,0 +1,378 @@
+#pragma once
+
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QString>
+#include <QStringList>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <vector>
+
+#include "pixelpool.h"
+#include "resampler.h"
+
+// Center crops of uncompressed BMP and TIFF files, read through a memory
+// mapping of the file without decoding it as a whole. Each source row is
+// handed to the resampler straight from the mapping (or widened to 32 bits
+// one row at a time), and only the rows, and for tiled TIFF the tiles,
+// under the crop are touched, so a 2 GB scan costs the pages of its
+// center crop instead of a read and a copy of the whole file.
+//
+// Handles BMP with 24 or 32 bits per pixel (BI_RGB, or BI_BITFIELDS with
+// the usual masks) and baseline TIFF without compression: 8-bit gray, RGB
+// or RGBA, chunky, in strips or tiles. Anything else comes back null and is
+// decoded by QImageReader.
+class MappedImage {
+public:
+    // Like CollageWorker::decodeCenterCrop: the centered crop with the
+    // aspect ratio of maxSize reduced to at most maxSize, sourceSide set to
+    // the side of the file's center square
+    static QImage loadCenterCrop(const QString& path, const QSize& maxSize, int* sourceSide = nullptr,
+                                 Resampler::Filter filter = Resampler::Filter::Lanczos3) {
+        if (!mayMap(path)) {
+            return QImage();
+        }
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly) || file.size() < 32) {
+            return QImage();
+        }
+        const qint64 size = file.size();
+        const uchar* data = file.map(0, size);
+        if (!data) {
+            return QImage();
+        }
+        Layout layout;
+        Bytes bytes{data, size, false};
+        if (!parseBmp(bytes, &layout) && !parseTiff(bytes, &layout)) {
+            return QImage();
+        }
+
+        const QSize bound = maxSize.expandedTo(QSize(1, 1));
+        const QRect crop = Resampler::centerRect(QSize(layout.width, layout.height), bound);
+        const QSize out = crop.width() <= bound.width() && crop.height() <= bound.height() ? crop.size() : bound;
+        auto row = [&](int y, uint32_t* scratch) {
+            return layout.row(crop.top() + y, crop.left(), crop.width(), scratch);
+        };
+
+        QImage image;
+        if (out == crop.size() && layout.format == Resampler::RowFormat::Premultiplied) {
+            // Nothing to scale: keep the alpha, like QImageReader would
+            image = PixelPool::instance().image(out.width(), out.height(), QImage::Format_ARGB32_Premultiplied);
+            PixelPool::Buffer scratch = PixelPool::instance().acquire(static_cast<size_t>(out.width()) * 4);
+            for (int y = 0; y < out.height(); y++) {
+                memcpy(image.scanLine(y), row(y, reinterpret_cast<uint32_t*>(scratch.data())),
+                       static_cast<size_t>(out.width()) * 4);
+            }
+        } else {
+            image = PixelPool::instance().image(out.width(), out.height(), QImage::Format_RGB32);
+            Resampler::resampleRows(row, crop.width(), crop.height(), layout.format, image, filter);
+        }
+        if (sourceSide) {
+            *sourceSide = std::min(layout.width, layout.height);
+        }
+        return image;
+    }
+
+    // Whether loadCenterCrop may read the file, and so whether its result
+    // depends on the filter. The contents decide, the suffix only saves
+    // mapping every JPEG.
+    static bool mayMap(const QString& path) {
+        static const QStringList suffixes = {"bmp", "dib", "tif", "tiff"};
+        return suffixes.contains(QFileInfo(path).suffix().toLower());
+    }
+
+private:
+    // Bounds-checked reads from the mapping
+    struct Bytes {
+        const uchar* data;
+        qint64 size;
+        bool bigEndian;
+
+        bool contains(qint64 offset, qint64 length) const {
+            return offset >= 0 && length >= 0 && offset <= size && length <= size - offset;
+        }
+        quint16 u16(qint64 offset) const {
+            if (!contains(offset, 2)) return 0;
+            const uchar* p = data + offset;
+            return bigEndian ? static_cast<quint16>(p[0] << 8 | p[1]) : static_cast<quint16>(p[1] << 8 | p[0]);
+        }
+        quint32 u32(qint64 offset) const {
+            if (!contains(offset, 4)) return 0;
+            const uchar* p = data + offset;
+            return bigEndian ? static_cast<quint32>(p[0]) << 24 | static_cast<quint32>(p[1]) << 16 | p[2] << 8 | p[3]
+                             : static_cast<quint32>(p[3]) << 24 | static_cast<quint32>(p[2]) << 16 | p[1] << 8 | p[0];
+        }
+    };
+
+    struct Layout {
+        int width = 0;
+        int height = 0;
+        Resampler::RowFormat format = Resampler::RowFormat::Rgb32;
+        // count 32-bit pixels of file row y starting at column left
+        std::function<const uint32_t*(int y, int left, int count, uint32_t* scratch)> row;
+    };
+
+    enum class Samples { Gray, Rgb, Rgbx, RgbaStraight, RgbaPremultiplied, Bgr, Bgra };
+
+    // count pixels of samples at in as 32-bit pixels in out
+    static void widen(const uchar* in, Samples samples, int count, uint32_t* out) {
+        for (int x = 0; x < count; x++) {
+            switch (samples) {
+            case Samples::Gray:
+                out[x] = 0xff000000u | in[x] * 0x010101u;
+                break;
+            case Samples::Rgb:
+                out[x] = 0xff000000u | static_cast<uint32_t>(in[x * 3]) << 16 | in[x * 3 + 1] << 8 | in[x * 3 + 2];
+                break;
+            case Samples::Rgbx:
+                out[x] = 0xff000000u | static_cast<uint32_t>(in[x * 4]) << 16 | in[x * 4 + 1] << 8 | in[x * 4 + 2];
+                break;
+            case Samples::RgbaPremultiplied:
+                out[x] = static_cast<uint32_t>(in[x * 4 + 3]) << 24 | static_cast<uint32_t>(in[x * 4]) << 16 |
+                         in[x * 4 + 1] << 8 | in[x * 4 + 2];
+                break;
+            case Samples::RgbaStraight:
+                out[x] = premultiply(in[x * 4], in[x * 4 + 1], in[x * 4 + 2], in[x * 4 + 3]);
+                break;
+            case Samples::Bgr:
+                out[x] = 0xff000000u | static_cast<uint32_t>(in[x * 3 + 2]) << 16 | in[x * 3 + 1] << 8 | in[x * 3];
+                break;
+            case Samples::Bgra:
+                out[x] = premultiply(in[x * 4 + 2], in[x * 4 + 1], in[x * 4], in[x * 4 + 3]);
+                break;
+            }
+        }
+    }
+
+    static uint32_t premultiply(int r, int g, int b, int a) {
+        auto scale = [a](int c) { return static_cast<uint32_t>((c * a + 127) / 255); };
+        return static_cast<uint32_t>(a) << 24 | scale(r) << 16 | scale(g) << 8 | scale(b);
+    }
+
+    static int bytesPerPixel(Samples samples) {
+        switch (samples) {
+        case Samples::Gray: return 1;
+        case Samples::Rgb:
+        case Samples::Bgr: return 3;
+        default: return 4;
+        }
+    }
+
+    static bool parseBmp(const Bytes& bytes, Layout* layout) {
+        if (bytes.data[0] != 'B' || bytes.data[1] != 'M') {
+            return false;
+        }
+        const quint32 pixelsOffset = bytes.u32(10);
+        const quint32 headerSize = bytes.u32(14);
+        const int width = static_cast<qint32>(bytes.u32(18));
+        const int rawHeight = static_cast<qint32>(bytes.u32(22));
+        const int bitsPerPixel = bytes.u16(28);
+        const quint32 compression = bytes.u32(30);
+        if (headerSize < 40 || bytes.u16(26) != 1 || width <= 0 || rawHeight == 0 || rawHeight == INT32_MIN) {
+            return false;
+        }
+        const bool topDown = rawHeight < 0;
+        const int height = topDown ? -rawHeight : rawHeight;
+
+        Samples samples;
+        if (bitsPerPixel == 24 && compression == 0) {
+            samples = Samples::Bgr;
+        } else if (bitsPerPixel == 32 && compression == 0) {
+            samples = Samples::Rgbx;
+        } else if (bitsPerPixel == 32 && compression == 3) {
+            // The masks follow a 40-byte header and are part of longer ones
+            if (bytes.u32(54) != 0x00ff0000u || bytes.u32(58) != 0x0000ff00u || bytes.u32(62) != 0x000000ffu) {
+                return false;
+            }
+            const quint32 alphaMask = headerSize >= 56 ? bytes.u32(66) : 0;
+            if (alphaMask != 0 && alphaMask != 0xff000000u) {
+                return false;
+            }
+            samples = alphaMask ? Samples::Bgra : Samples::Rgbx;
+        } else {
+            return false;
+        }
+
+        const qint64 rowBytes = (static_cast<qint64>(width) * bitsPerPixel + 31) / 32 * 4;
+        if (!bytes.contains(pixelsOffset, rowBytes * height)) {
+            return false;
+        }
+        const uchar* pixels = bytes.data + pixelsOffset;
+        layout->width = width;
+        layout->height = height;
+        auto fileRow = [=](int y) { return pixels + (topDown ? y : height - 1 - y) * rowBytes; };
+        if (samples == Samples::Rgbx) {
+            // BGRX in memory is Qt's RGB32 apart from the padding byte: no
+            // copy, unless the pixels don't start on a 4-byte boundary (after
+            // a 54-byte header they usually don't)
+            layout->format = Resampler::RowFormat::Rgbx32;
+            if (reinterpret_cast<quintptr>(pixels) % 4 == 0 && rowBytes % 4 == 0) {
+                layout->row = [=](int y, int left, int, uint32_t*) {
+                    return reinterpret_cast<const uint32_t*>(fileRow(y)) + left;
+                };
+            } else {
+                layout->row = [=](int y, int left, int count, uint32_t* scratch) {
+                    memcpy(scratch, fileRow(y) + static_cast<qint64>(left) * 4, static_cast<size_t>(count) * 4);
+                    return const_cast<const uint32_t*>(scratch);
+                };
+            }
+        } else {
+            layout->format = samples == Samples::Bgra ? Resampler::RowFormat::Premultiplied : Resampler::RowFormat::Rgb32;
+            layout->row = [=](int y, int left, int count, uint32_t* scratch) {
+                widen(fileRow(y) + static_cast<qint64>(left) * bytesPerPixel(samples), samples, count, scratch);
+                return const_cast<const uint32_t*>(scratch);
+            };
+        }
+        return true;
+    }
+
+    // All values of a SHORT or LONG field, from the entry or where it points
+    static std::vector<quint32> tiffValues(const Bytes& bytes, qint64 entry) {
+        const quint16 type = bytes.u16(entry + 2);
+        const quint32 count = bytes.u32(entry + 4);
+        const int width = type == 3 ? 2 : type == 4 ? 4 : 0;
+        std::vector<quint32> values;
+        if (width == 0 || count == 0 || count > 1u << 24) {
+            return values;
+        }
+        const qint64 offset = static_cast<qint64>(count) * width <= 4 ? entry + 8 : bytes.u32(entry + 8);
+        if (!bytes.contains(offset, static_cast<qint64>(count) * width)) {
+            return values;
+        }
+        values.resize(count);
+        for (quint32 i = 0; i < count; i++) {
+            values[i] = width == 2 ? bytes.u16(offset + i * 2) : bytes.u32(offset + i * 4);
+        }
+        return values;
+    }
+
+    static bool parseTiff(Bytes bytes, Layout* layout) {
+        if (memcmp(bytes.data, "II*\0", 4) == 0) {
+            bytes.bigEndian = false;
+        } else if (memcmp(bytes.data, "MM\0*", 4) == 0) {
+            bytes.bigEndian = true;
+        } else {
+            return false;
+        }
+
+        // Only the first image of the file, as QImageReader reads it
+        const qint64 ifd = bytes.u32(4);
+        const int entries = bytes.u16(ifd);
+        if (entries == 0 || !bytes.contains(ifd + 2, static_cast<qint64>(entries) * 12)) {
+            return false;
+        }
+        quint32 width = 0, height = 0, compression = 1, photometric = 0, samplesPerPixel = 1,
+                planar = 1, orientation = 1, extra = 0, tileWidth = 0, tileHeight = 0;
+        quint32 rowsPerStrip = UINT32_MAX;
+        std::vector<quint32> bitsPerSample, offsets, counts;
+        bool tiled = false;
+        for (int i = 0; i < entries; i++) {
+            const qint64 entry = ifd + 2 + static_cast<qint64>(i) * 12;
+            const std::vector<quint32> values = tiffValues(bytes, entry);
+            const quint32 first = values.empty() ? 0 : values.front();
+            switch (bytes.u16(entry)) {
+            case 256: width = first; break;
+            case 257: height = first; break;
+            case 258: bitsPerSample = values; break;
+            case 259: compression = first; break;
+            case 262: photometric = first; break;
+            case 273: offsets = values; break;
+            case 274: orientation = first; break;
+            case 277: samplesPerPixel = first; break;
+            case 278: rowsPerStrip = first; break;
+            case 279: counts = values; break;
+            case 284: planar = first; break;
+            case 322: tileWidth = first; break;
+            case 323: tileHeight = first; break;
+            case 324: offsets = values; tiled = true; break;
+            case 325: counts = values; break;
+            case 338: extra = first; break;
+            default: break;
+            }
+        }
+
+        if (width == 0 || height == 0 || width > INT32_MAX / 4 || height > INT32_MAX || compression != 1 ||
+            planar != 1 || orientation != 1 || offsets.empty() || counts.size() != offsets.size()) {
+            return false;
+        }
+        // Without the tag a sample is 1 bit
+        if (bitsPerSample.size() != samplesPerPixel) {
+            return false;
+        }
+        for (quint32 bits : bitsPerSample) {
+            if (bits != 8) return false;
+        }
+        Samples samples;
+        if (photometric == 1 && samplesPerPixel == 1) {
+            samples = Samples::Gray;
+        } else if (photometric == 2 && samplesPerPixel == 3) {
+            samples = Samples::Rgb;
+        } else if (photometric == 2 && samplesPerPixel == 4) {
+            samples = extra == 1 ? Samples::RgbaPremultiplied : extra == 2 ? Samples::RgbaStraight : Samples::Rgbx;
+        } else {
+            return false;
+        }
+        const int pixelBytes = bytesPerPixel(samples);
+
+        // Every strip or tile must lie in the file before any row is read
+        auto inFile = [&](size_t index, qint64 length) {
+            return bytes.contains(offsets[index], length) && counts[index] >= length;
+        };
+        const uchar* data = bytes.data;
+        layout->width = static_cast<int>(width);
+        layout->height = static_cast<int>(height);
+        layout->format = samples == Samples::RgbaPremultiplied || samples == Samples::RgbaStraight
+            ? Resampler::RowFormat::Premultiplied : Resampler::RowFormat::Rgb32;
+        if (!tiled) {
+            rowsPerStrip = std::min(rowsPerStrip, height);
+            const qint64 rowBytes = static_cast<qint64>(width) * pixelBytes;
+            const size_t strips = (height + rowsPerStrip - 1) / rowsPerStrip;
+            if (rowsPerStrip == 0 || offsets.size() < strips) {
+                return false;
+            }
+            for (size_t strip = 0; strip < strips; strip++) {
+                const quint32 rows = std::min(rowsPerStrip, height - static_cast<quint32>(strip) * rowsPerStrip);
+                if (!inFile(strip, rows * rowBytes)) return false;
+            }
+            layout->row = [=](int y, int left, int count, uint32_t* scratch) {
+                const uchar* line = data + offsets[static_cast<size_t>(y) / rowsPerStrip] +
+                                    static_cast<qint64>(y % rowsPerStrip) * rowBytes;
+                widen(line + static_cast<qint64>(left) * pixelBytes, samples, count, scratch);
+                return const_cast<const uint32_t*>(scratch);
+            };
+            return true;
+        }
+
+        // Tiles are multiples of 16 pixels and may stick out of the image
+        if (tileWidth == 0 || tileHeight == 0 || tileWidth % 16 || tileHeight % 16 ||
+            tileWidth > 1u << 16 || tileHeight > 1u << 16) {
+            return false;
+        }
+        const size_t across = (width + tileWidth - 1) / tileWidth;
+        const size_t down = (height + tileHeight - 1) / tileHeight;
+        const qint64 tileRowBytes = static_cast<qint64>(tileWidth) * pixelBytes;
+        if (offsets.size() < across * down) {
+            return false;
+        }
+        for (size_t tile = 0; tile < across * down; tile++) {
+            if (!inFile(tile, tileRowBytes * tileHeight)) return false;
+        }
+        layout->row = [=](int y, int left, int count, uint32_t* scratch) {
+            const size_t tileRow = static_cast<size_t>(y) / tileHeight;
+            const qint64 lineOffset = static_cast<qint64>(y % tileHeight) * tileRowBytes;
+            for (int x = left; x < left + count;) {
+                const size_t tileCol = static_cast<size_t>(x) / tileWidth;
+                const int inTile = x - static_cast<int>(tileCol * tileWidth);
+                const int run = std::min(left + count - x, static_cast<int>(tileWidth) - inTile);
+                const uchar* line = data + offsets[tileRow * across + tileCol] + lineOffset;
+                widen(line + static_cast<qint64>(inTile) * pixelBytes, samples, run, scratch + (x - left));
+                x += run;
+            }
+            return const_cast<const uint32_t*>(scratch);
+        };
+        return true;
+    }
+};
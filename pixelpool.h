@@ -0,0 +1,206 @@
+#pragma once
+
+#include <QImage>
+#include <QMutex>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include "stats.h"
+
+// Recycled memory for the large short-lived buffers of an export: decoded
+// squares, resampler scratch, cached tiles, bands and canvases. Requests
+// are rounded up to size classes a quarter power of two apart, so a block
+// fits any later request of its class and wastes at most a fifth of
+// itself. Freed blocks go back to their class instead of to the heap, up to
+// budget bytes; a steady batch of similar collages allocates nothing large
+// once the first few have run.
+//
+// Any thread may use it. The images it hands out are ordinary QImages: the
+// block returns to the pool when the last copy goes away, and a copy that
+// detaches gets heap memory of its own.
+class PixelPool {
+    struct Block;
+
+public:
+    // Scratch memory for the lifetime of the object
+    class Buffer {
+    public:
+        Buffer() = default;
+        Buffer(Buffer&& other) noexcept : block(std::exchange(other.block, nullptr)) {}
+        Buffer& operator=(Buffer&& other) noexcept {
+            std::swap(block, other.block);
+            return *this;
+        }
+        ~Buffer() {
+            if (block) {
+                instance().release(block);
+            }
+        }
+
+        uchar* data() const { return block ? pixels(block) : nullptr; }
+
+    private:
+        friend class PixelPool;
+        explicit Buffer(Block* block) : block(block) {}
+        Block* block = nullptr;
+    };
+
+    // Never destroyed: images held by static caches may still hand their
+    // blocks back while the process exits
+    static PixelPool& instance() {
+        static PixelPool* pool = new PixelPool;
+        return *pool;
+    }
+
+    PixelPool(const PixelPool&) = delete;
+    PixelPool& operator=(const PixelPool&) = delete;
+
+    Buffer acquire(size_t bytes) {
+        return Buffer(take(bytes));
+    }
+
+    // An uninitialized width x height image of format in pooled memory, null
+    // for an empty size or an invalid format
+    QImage image(int width, int height, QImage::Format format) {
+        if (width <= 0 || height <= 0 || format == QImage::Format_Invalid) {
+            return QImage();
+        }
+        const int bytesPerLine = (width * QImage::toPixelFormat(format).bitsPerPixel() + 31) / 32 * 4;
+        Block* block = take(static_cast<size_t>(bytesPerLine) * height);
+        return QImage(pixels(block), width, height, bytesPerLine, format, releaseImage, block);
+    }
+
+    // A deep copy of source, which may be a view, in pooled memory
+    QImage copy(const QImage& source) {
+        QImage result = image(source.width(), source.height(), source.format());
+        if (result.isNull()) {
+            return source.copy();
+        }
+        const size_t rowBytes = std::min(static_cast<size_t>(source.bytesPerLine()),
+                                         static_cast<size_t>(result.bytesPerLine()));
+        for (int y = 0; y < source.height(); y++) {
+            memcpy(result.scanLine(y), source.constScanLine(y), rowBytes);
+        }
+        result.setColorTable(source.colorTable());
+        return result;
+    }
+
+    // Free blocks kept beyond this are given back to the heap
+    void setBudget(qint64 bytes) {
+        QMutexLocker locker(&mutex);
+        budget = bytes;
+        trimLocked();
+    }
+
+    // Bytes in blocks waiting for reuse
+    qint64 retained() const {
+        QMutexLocker locker(&mutex);
+        return retainedBytes;
+    }
+
+    // Bytes in blocks out in images and buffers
+    qint64 inUse() const {
+        QMutexLocker locker(&mutex);
+        return inUseBytes;
+    }
+
+private:
+    // Pixels start one cache line into the block
+    struct Block {
+        int sizeClass;
+    };
+    static constexpr size_t headerSize = 64;
+    static constexpr size_t minimumShift = 12; // 4 KB, smaller requests share the first class
+
+    mutable QMutex mutex;
+    std::vector<std::vector<Block*>> freeBlocks;
+    qint64 budget = 512LL * 1024 * 1024;
+    qint64 retainedBytes = 0;
+    qint64 inUseBytes = 0;
+
+    PixelPool() = default;
+
+    static uchar* pixels(Block* block) {
+        return reinterpret_cast<uchar*>(block) + headerSize;
+    }
+
+    // Four classes per power of two: 1, 1.25, 1.5 and 1.75 times 2^shift
+    static int sizeClassFor(size_t bytes) {
+        size_t shift = minimumShift;
+        while ((size_t(1) << (shift + 1)) < bytes) {
+            shift++;
+        }
+        const size_t base = size_t(1) << shift;
+        if (bytes <= base) {
+            return static_cast<int>((shift - minimumShift) * 4);
+        }
+        const size_t quarters = (bytes - base + (base / 4) - 1) / (base / 4); // 1..4
+        return static_cast<int>((shift - minimumShift) * 4 + quarters);
+    }
+
+    static size_t classBytes(int sizeClass) {
+        const size_t base = size_t(1) << (minimumShift + static_cast<size_t>(sizeClass / 4));
+        return base + base / 4 * static_cast<size_t>(sizeClass % 4);
+    }
+
+    Block* take(size_t bytes) {
+        const int sizeClass = sizeClassFor(std::max<size_t>(bytes, 1));
+        const size_t size = classBytes(sizeClass);
+        {
+            QMutexLocker locker(&mutex);
+            inUseBytes += static_cast<qint64>(size);
+            if (static_cast<size_t>(sizeClass) < freeBlocks.size() && !freeBlocks[static_cast<size_t>(sizeClass)].empty()) {
+                Block* block = freeBlocks[static_cast<size_t>(sizeClass)].back();
+                freeBlocks[static_cast<size_t>(sizeClass)].pop_back();
+                retainedBytes -= static_cast<qint64>(size);
+                Stats::instance().count(Stats::Counter::PoolHit);
+                return block;
+            }
+        }
+        Stats::instance().count(Stats::Counter::PoolMiss);
+        void* memory = ::operator new(headerSize + size, std::align_val_t(headerSize));
+        Block* block = static_cast<Block*>(memory);
+        block->sizeClass = sizeClass;
+        return block;
+    }
+
+    void release(Block* block) {
+        const size_t size = classBytes(block->sizeClass);
+        QMutexLocker locker(&mutex);
+        inUseBytes -= static_cast<qint64>(size);
+        if (retainedBytes + static_cast<qint64>(size) > budget) {
+            locker.unlock();
+            destroy(block);
+            return;
+        }
+        if (freeBlocks.size() <= static_cast<size_t>(block->sizeClass)) {
+            freeBlocks.resize(static_cast<size_t>(block->sizeClass) + 1);
+        }
+        freeBlocks[static_cast<size_t>(block->sizeClass)].push_back(block);
+        retainedBytes += static_cast<qint64>(size);
+    }
+
+    // Largest blocks first, they are the rarest to be asked for again
+    void trimLocked() {
+        for (size_t sizeClass = freeBlocks.size(); sizeClass-- > 0 && retainedBytes > budget;) {
+            std::vector<Block*>& blocks = freeBlocks[sizeClass];
+            while (!blocks.empty() && retainedBytes > budget) {
+                retainedBytes -= static_cast<qint64>(classBytes(static_cast<int>(sizeClass)));
+                destroy(blocks.back());
+                blocks.pop_back();
+            }
+        }
+    }
+
+    static void destroy(Block* block) {
+        ::operator delete(block, std::align_val_t(headerSize));
+    }
+
+    static void releaseImage(void* block) {
+        instance().release(static_cast<Block*>(block));
+    }
+};
@@ -0,0 +1,496 @@
+#pragma once
+
+#include <QIODevice>
+#include <QImage>
+#include <QByteArray>
+#include <QString>
+#include <QtConcurrent>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef COLLAGE_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// PNG encoder that takes the image a band of rows at a time, so a collage
+// never has to exist as one QImage. Writes 8-bit RGB with per-row adaptive
+// filtering. Filtering and, with zlib, deflate run on the thread pool: the
+// band is cut into chunks that are compressed independently pigz-style and
+// concatenated into one zlib stream. Without zlib the stream is made of
+// stored deflate blocks: a valid but uncompressed PNG.
+//
+// encodeBand/writeBand are the cacheable alternative to writeRows: such a
+// band doesn't depend on the rows before it (its first row is filtered
+// without the row above, its deflate data without a dictionary), so an
+// encoded band can be written again into a later image with the same width
+// and level. Use one style or the other within an image.
+class PngWriter {
+public:
+    struct EncodedBand {
+        QByteArray data;    // deflate blocks, byte aligned, not final
+        quint32 adler = 1;  // of the filtered bytes
+        qint64 size = 0;    // number of filtered bytes
+        int rows = 0;
+    };
+
+    explicit PngWriter(QIODevice* device, int compressionLevel = 6)
+        : device(device), level(compressionLevel) {}
+
+    PngWriter(const PngWriter&) = delete;
+    PngWriter& operator=(const PngWriter&) = delete;
+
+    bool begin(int imageWidth, int imageHeight) {
+        width = imageWidth;
+        height = imageHeight;
+        rowsWritten = 0;
+        rowBytes = static_cast<size_t>(width) * 3;
+        previousRow.assign(rowBytes, 0);
+        adler = 1;
+        compressed.clear();
+
+        static const char signature[8] = {'\x89', 'P', 'N', 'G', '\r', '\n', '\x1a', '\n'};
+        if (!writeRaw(signature, sizeof(signature))) {
+            return false;
+        }
+
+        QByteArray header;
+        appendBigEndian(header, static_cast<quint32>(width));
+        appendBigEndian(header, static_cast<quint32>(height));
+        header.append(char(8));  // bit depth
+        header.append(char(2));  // color type: RGB
+        header.append(char(0));  // deflate
+        header.append(char(0));  // adaptive filtering
+        header.append(char(0));  // no interlace
+        if (!writeChunk("IHDR", header)) {
+            return false;
+        }
+
+        // zlib stream header: deflate, 32 KB window, no preset dictionary
+        compressed.append(char(0x78));
+        compressed.append(char(level >= 1 && level <= 9 ? 0x9c : 0x01));
+        return true;
+    }
+
+    // rows must be Format_RGB32 and exactly width pixels wide
+    bool writeRows(const QImage& rows) {
+        if (rowsWritten + rows.height() > height) {
+            error = "Лишние строки изображения";
+            return false;
+        }
+        filterBand(rows, &previousRow, bandFiltered);
+        if (!compress(bandFiltered.data(), bandFiltered.size())) {
+            return false;
+        }
+        rowsWritten += rows.height();
+        return flushIdat(false);
+    }
+
+    EncodedBand encodeBand(const QImage& rows) const {
+        EncodedBand band;
+        band.rows = rows.height();
+        std::vector<uchar> filtered;
+        filterBand(rows, nullptr, filtered);
+        band.size = static_cast<qint64>(filtered.size());
+        if (!deflateIndependent(filtered.data(), filtered.size(), band)) {
+            band.rows = -1;
+        }
+        return band;
+    }
+
+    bool writeBand(const EncodedBand& band) {
+        if (band.rows < 0) {
+            error = "Ошибка сжатия zlib";
+            return false;
+        }
+        if (rowsWritten + band.rows > height) {
+            error = "Лишние строки изображения";
+            return false;
+        }
+        compressed.append(band.data);
+        adler = adler32Combine(adler, band.adler, band.size);
+        rowsWritten += band.rows;
+        return flushIdat(false);
+    }
+
+    int imageWidth() const { return width; }
+    int compressionLevel() const { return level; }
+
+    bool finish() {
+        if (rowsWritten != height) {
+            error = "Записаны не все строки изображения";
+            return false;
+        }
+        if (!finishStream() || !flushIdat(true)) {
+            return false;
+        }
+        return writeChunk("IEND", QByteArray());
+    }
+
+    QString errorString() const { return error; }
+
+private:
+    QIODevice* device;
+    int level;
+    int width = 0;
+    int height = 0;
+    int rowsWritten = 0;
+    size_t rowBytes = 0;
+    std::vector<uchar> previousRow;   // last unfiltered RGB row of the previous band
+    std::vector<uchar> bandFiltered;  // filter type byte + filtered row, per row
+    quint32 adler = 1;                // of all filtered bytes so far
+    QByteArray compressed;            // zlib stream not yet written as IDAT
+    QString error;
+
+    // Flush IDAT data in chunks of about this size
+    static constexpr int idatChunkSize = 1 << 20;
+    // Rows filtered by one pool task
+    static constexpr int filterRowsPerTask = 16;
+
+    static int paeth(int a, int b, int c) {
+        int p = a + b - c;
+        int pa = std::abs(p - a);
+        int pb = std::abs(p - b);
+        int pc = std::abs(p - c);
+        if (pa <= pb && pa <= pc) return a;
+        if (pb <= pc) return b;
+        return c;
+    }
+
+    static void toRgb(const QImage& rows, int y, uchar* rgb, int width) {
+        const QRgb* source = reinterpret_cast<const QRgb*>(rows.constScanLine(y));
+        for (int x = 0; x < width; x++) {
+            *rgb++ = static_cast<uchar>(qRed(source[x]));
+            *rgb++ = static_cast<uchar>(qGreen(source[x]));
+            *rgb++ = static_cast<uchar>(qBlue(source[x]));
+        }
+    }
+
+    // Tries the PNG filters and keeps the one with the smallest sum of
+    // absolute values, the usual heuristic for photographic content. Without
+    // a row above only None and Sub are possible. out receives the filter
+    // type byte followed by rowBytes filtered bytes.
+    static void filterRow(const uchar* cur, const uchar* up, size_t rowBytes,
+                          uchar* out, std::vector<uchar>& scratch) {
+        scratch.resize(rowBytes + 1);
+        long bestScore = -1;
+
+        const int types = up ? 5 : 2;
+        for (int type = 0; type < types; type++) {
+            scratch[0] = static_cast<uchar>(type);
+            long score = 0;
+            for (size_t i = 0; i < rowBytes; i++) {
+                int left = i >= 3 ? cur[i - 3] : 0;
+                int above = up ? up[i] : 0;
+                int upLeft = up && i >= 3 ? up[i - 3] : 0;
+                int predicted = 0;
+                switch (type) {
+                case 1: predicted = left; break;
+                case 2: predicted = above; break;
+                case 3: predicted = (left + above) / 2; break;
+                case 4: predicted = paeth(left, above, upLeft); break;
+                default: break;
+                }
+                uchar value = static_cast<uchar>(cur[i] - predicted);
+                scratch[i + 1] = value;
+                score += value < 128 ? value : 256 - value;
+            }
+            if (bestScore < 0 || score < bestScore) {
+                bestScore = score;
+                memcpy(out, scratch.data(), rowBytes + 1);
+            }
+        }
+    }
+
+    // previous is the unfiltered last row of the band above, updated to this
+    // band's last row; null for an independent band
+    void filterBand(const QImage& rows, std::vector<uchar>* previous, std::vector<uchar>& filtered) const {
+        const int count = rows.height();
+        const size_t filteredStride = rowBytes + 1;
+        filtered.resize(static_cast<size_t>(count) * filteredStride);
+
+        std::vector<int> starts;
+        for (int y = 0; y < count; y += filterRowsPerTask) {
+            starts.push_back(y);
+        }
+
+        QtConcurrent::blockingMap(starts, [&](int start) {
+            int end = std::min(start + filterRowsPerTask, count);
+            std::vector<uchar> up(rowBytes), cur(rowBytes), scratch;
+            bool hasUp = true;
+            if (start > 0) {
+                toRgb(rows, start - 1, up.data(), width);
+            } else if (previous) {
+                up = *previous;
+            } else {
+                hasUp = false;
+            }
+            for (int y = start; y < end; y++) {
+                toRgb(rows, y, cur.data(), width);
+                filterRow(cur.data(), hasUp ? up.data() : nullptr, rowBytes,
+                          filtered.data() + static_cast<size_t>(y) * filteredStride, scratch);
+                up.swap(cur);
+                hasUp = true;
+            }
+        });
+
+        if (count > 0 && previous) {
+            toRgb(rows, count - 1, previous->data(), width);
+        }
+    }
+
+#ifdef COLLAGE_HAVE_ZLIB
+    // Deflate input per pool task, large enough to keep the ratio close to
+    // a single stream
+    static constexpr size_t deflateChunkSize = 256 * 1024;
+    static constexpr size_t windowSize = 32 * 1024;
+
+    struct DeflateChunk {
+        const uchar* data;
+        size_t size;
+        const uchar* dictionary;
+        size_t dictionarySize;
+        QByteArray output;
+        quint32 adler = 1;
+        bool ok = false;
+    };
+
+    std::vector<uchar> window;        // last 32 KB of input, primes the next band
+
+    // Raw deflate of one chunk ending with a sync flush: byte aligned and not
+    // final, so the next chunk's output can follow it directly
+    static void deflateChunk(DeflateChunk& chunk, int level) {
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            return;
+        }
+        if (chunk.dictionarySize > 0) {
+            deflateSetDictionary(&stream, chunk.dictionary, static_cast<uInt>(chunk.dictionarySize));
+        }
+        chunk.output.resize(static_cast<int>(deflateBound(&stream, static_cast<uLong>(chunk.size)) + 16));
+        stream.next_in = const_cast<Bytef*>(chunk.data);
+        stream.avail_in = static_cast<uInt>(chunk.size);
+        int result = Z_OK;
+        // The flush is complete only when deflate leaves room in the output,
+        // as in pigz: a full buffer may still hold back the sync marker
+        do {
+            if (stream.total_out == static_cast<uLong>(chunk.output.size())) {
+                chunk.output.resize(chunk.output.size() * 2);
+            }
+            stream.next_out = reinterpret_cast<Bytef*>(chunk.output.data()) + stream.total_out;
+            stream.avail_out = static_cast<uInt>(chunk.output.size() - static_cast<int>(stream.total_out));
+            result = deflate(&stream, Z_SYNC_FLUSH);
+        } while ((result == Z_OK || result == Z_BUF_ERROR) && stream.avail_out == 0);
+        chunk.ok = (result == Z_OK || result == Z_BUF_ERROR) && stream.avail_in == 0 && stream.avail_out != 0;
+        chunk.output.resize(static_cast<int>(stream.total_out));
+        deflateEnd(&stream);
+        chunk.adler = static_cast<quint32>(::adler32(1, chunk.data, static_cast<uInt>(chunk.size)));
+    }
+
+    // Deflates data as parallel chunks appended to out, the first one primed
+    // with dictionary; adlerValue is carried over the data
+    bool deflateParallel(const uchar* data, size_t size, const uchar* dictionary, size_t dictionarySize,
+                         QByteArray& out, quint32& adlerValue) const {
+        std::vector<DeflateChunk> chunks;
+        for (size_t offset = 0; offset < size; offset += deflateChunkSize) {
+            DeflateChunk chunk;
+            chunk.data = data + offset;
+            chunk.size = std::min(deflateChunkSize, size - offset);
+            if (offset > 0) {
+                chunk.dictionarySize = std::min(windowSize, offset);
+                chunk.dictionary = chunk.data - chunk.dictionarySize;
+            } else {
+                chunk.dictionarySize = dictionarySize;
+                chunk.dictionary = dictionary;
+            }
+            chunks.push_back(chunk);
+        }
+
+        const int chunkLevel = level;
+        QtConcurrent::blockingMap(chunks, [chunkLevel](DeflateChunk& chunk) {
+            deflateChunk(chunk, chunkLevel);
+        });
+
+        for (const DeflateChunk& chunk : chunks) {
+            if (!chunk.ok) {
+                return false;
+            }
+            out.append(chunk.output);
+            adlerValue = adler32Combine(adlerValue, chunk.adler, static_cast<qint64>(chunk.size));
+        }
+        return true;
+    }
+
+    bool deflateIndependent(const uchar* data, size_t size, EncodedBand& band) const {
+        return deflateParallel(data, size, nullptr, 0, band.data, band.adler);
+    }
+
+    static quint32 adler32Combine(quint32 first, quint32 second, qint64 secondSize) {
+        return static_cast<quint32>(adler32_combine(first, second, static_cast<z_off_t>(secondSize)));
+    }
+
+    bool compress(const uchar* data, size_t size) {
+        if (!deflateParallel(data, size, window.data(), window.size(), compressed, adler)) {
+            error = "Ошибка сжатия zlib";
+            return false;
+        }
+
+        // Keep the tail as dictionary for the first chunk of the next band
+        size_t keep = std::min(windowSize, size);
+        window.insert(window.end(), data + size - keep, data + size);
+        if (window.size() > windowSize) {
+            window.erase(window.begin(), window.end() - static_cast<std::ptrdiff_t>(windowSize));
+        }
+        return true;
+    }
+
+    bool finishStream() {
+        // Empty final block closes the stream, then the checksum
+        z_stream stream;
+        memset(&stream, 0, sizeof(stream));
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            error = "Не удалось инициализировать zlib";
+            return false;
+        }
+        uchar buffer[64];
+        stream.next_out = buffer;
+        stream.avail_out = sizeof(buffer);
+        const int result = deflate(&stream, Z_FINISH);
+        if (result != Z_STREAM_END) {
+            deflateEnd(&stream);
+            error = "Ошибка сжатия zlib";
+            return false;
+        }
+        compressed.append(reinterpret_cast<const char*>(buffer), static_cast<int>(stream.total_out));
+        deflateEnd(&stream);
+        appendBigEndian(compressed, adler);
+        return true;
+    }
+#else
+    QByteArray pendingStored;         // input of the next stored block
+
+    // Stored deflate blocks (BTYPE 00) of up to 65535 bytes
+    bool compress(const uchar* data, size_t size) {
+        adler = adler32(adler, data, size);
+        pendingStored.append(reinterpret_cast<const char*>(data), static_cast<int>(size));
+        int offset = 0;
+        while (pendingStored.size() - offset >= 65535) {
+            emitStoredBlock(compressed, pendingStored.constData() + offset, 65535, false);
+            offset += 65535;
+        }
+        pendingStored.remove(0, offset);
+        return true;
+    }
+
+    bool deflateIndependent(const uchar* data, size_t size, EncodedBand& band) const {
+        band.adler = adler32(1, data, size);
+        for (size_t offset = 0; offset < size; offset += 65535) {
+            int blockSize = static_cast<int>(std::min<size_t>(65535, size - offset));
+            emitStoredBlock(band.data, reinterpret_cast<const char*>(data + offset), blockSize, false);
+        }
+        return true;
+    }
+
+    // zlib's adler32_combine
+    static quint32 adler32Combine(quint32 first, quint32 second, qint64 secondSize) {
+        const quint64 base = 65521;
+        const quint64 remainder = static_cast<quint64>(secondSize) % base;
+        quint64 sum1 = first & 0xffff;
+        quint64 sum2 = (remainder * sum1) % base;
+        sum1 += (second & 0xffff) + base - 1;
+        sum2 += (first >> 16) + (second >> 16) + base - remainder;
+        sum1 %= base;
+        sum2 %= base;
+        return static_cast<quint32>(sum1 | (sum2 << 16));
+    }
+
+    bool finishStream() {
+        emitStoredBlock(compressed, pendingStored.constData(), pendingStored.size(), true);
+        pendingStored.clear();
+        appendBigEndian(compressed, adler);
+        return true;
+    }
+
+    static void emitStoredBlock(QByteArray& out, const char* data, int size, bool final) {
+        out.append(char(final ? 1 : 0));
+        out.append(char(size & 0xff));
+        out.append(char((size >> 8) & 0xff));
+        out.append(char(~size & 0xff));
+        out.append(char((~size >> 8) & 0xff));
+        out.append(data, size);
+    }
+
+    static quint32 adler32(quint32 value, const uchar* data, size_t size) {
+        quint32 a = value & 0xffff;
+        quint32 b = value >> 16;
+        while (size > 0) {
+            // 5552 is the largest run that can't overflow before the modulo
+            size_t run = std::min<size_t>(size, 5552);
+            size -= run;
+            while (run--) {
+                a += *data++;
+                b += a;
+            }
+            a %= 65521;
+            b %= 65521;
+        }
+        return (b << 16) | a;
+    }
+#endif
+
+    bool flushIdat(bool all) {
+        while (compressed.size() >= idatChunkSize || (all && !compressed.isEmpty())) {
+            int size = std::min(compressed.size(), idatChunkSize);
+            if (!writeChunk("IDAT", compressed.left(size))) {
+                return false;
+            }
+            compressed.remove(0, size);
+        }
+        return true;
+    }
+
+    bool writeChunk(const char* type, const QByteArray& data) {
+        QByteArray chunk;
+        appendBigEndian(chunk, static_cast<quint32>(data.size()));
+        chunk.append(type, 4);
+        chunk.append(data);
+        appendBigEndian(chunk, crc32(chunk.constData() + 4, chunk.size() - 4));
+        return writeRaw(chunk.constData(), chunk.size());
+    }
+
+    bool writeRaw(const char* data, qint64 size) {
+        if (device->write(data, size) != size) {
+            error = device->errorString();
+            return false;
+        }
+        return true;
+    }
+
+    static void appendBigEndian(QByteArray& out, quint32 value) {
+        out.append(char((value >> 24) & 0xff));
+        out.append(char((value >> 16) & 0xff));
+        out.append(char((value >> 8) & 0xff));
+        out.append(char(value & 0xff));
+    }
+
+    static quint32 crc32(const char* data, int size) {
+        static const std::vector<quint32> table = [] {
+            std::vector<quint32> t(256);
+            for (quint32 n = 0; n < 256; n++) {
+                quint32 c = n;
+                for (int k = 0; k < 8; k++) {
+                    c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+                }
+                t[n] = c;
+            }
+            return t;
+        }();
+        quint32 crc = 0xffffffffu;
+        for (int i = 0; i < size; i++) {
+            crc = table[(crc ^ static_cast<uchar>(data[i])) & 0xff] ^ (crc >> 8);
+        }
+        return crc ^ 0xffffffffu;
+    }
+};
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QImage>
+#include <QMutex>
+#include <QString>
+#include <list>
+#include <map>
+#include <vector>
+
+#include "pngwriter.h"
+#include "resampler.h"
+#include "stats.h"
+
+// What earlier exports produced, so the next one only redoes what changed:
+// resampled tiles keyed by (file, mtime, tile size, filter) in an LRU with
+// a byte budget, plus the last in-memory collage and the encoded PNG bands
+// of the last export, each with the cell keys it was made from. The GUI owns
+// it; workers read and fill it from pool threads.
+class RenderCache {
+public:
+    // The last collage built in memory. cells holds rows * cols tile keys
+    // in row-major order, empty for blank cells.
+    struct Canvas {
+        QImage image;
+        std::vector<QString> cells;
+        int rows = 0;
+        int cols = 0;
+        QSize tileSize;
+    };
+
+    using Bands = std::map<QString, PngWriter::EncodedBand>;
+
+    explicit RenderCache(qint64 budgetBytes) : budget(budgetBytes) {}
+
+    RenderCache(const RenderCache&) = delete;
+    RenderCache& operator=(const RenderCache&) = delete;
+
+    // A changed file gets a new mtime and thus a new key
+    static QString tileKey(const QString& path, const QSize& tileSize, Resampler::Filter filter) {
+        return QString("%1|%2|%3x%4|%5").arg(path)
+            .arg(QFileInfo(path).lastModified().toMSecsSinceEpoch())
+            .arg(tileSize.width()).arg(tileSize.height()).arg(static_cast<int>(filter));
+    }
+
+    QImage tile(const QString& key) {
+        QMutexLocker locker(&mutex);
+        auto it = tiles.find(key);
+        if (it == tiles.end()) {
+            Stats::instance().count(Stats::Counter::TileMiss);
+            return QImage();
+        }
+        Stats::instance().count(Stats::Counter::TileHit);
+        lru.splice(lru.begin(), lru, it->second.lruPos);
+        return it->second.image;
+    }
+
+    void insertTile(const QString& key, const QImage& image) {
+        QMutexLocker locker(&mutex);
+        if (tiles.count(key)) {
+            return;
+        }
+        lru.push_front(key);
+        tiles[key] = {image, lru.begin()};
+        tileBytes += image.sizeInBytes();
+        evict();
+    }
+
+    Canvas canvas() {
+        QMutexLocker locker(&mutex);
+        return lastCanvas;
+    }
+
+    // Dropped right away if it alone would not fit the budget
+    void setCanvas(const Canvas& canvas) {
+        QMutexLocker locker(&mutex);
+        lastCanvas = canvas.image.sizeInBytes() <= budget / 2 ? canvas : Canvas();
+        evict();
+    }
+
+    // Encoded band by its key, rows < 0 if there is none
+    PngWriter::EncodedBand band(const QString& key) {
+        QMutexLocker locker(&mutex);
+        auto it = lastBands.find(key);
+        if (it == lastBands.end()) {
+            Stats::instance().count(Stats::Counter::BandMiss);
+            PngWriter::EncodedBand missing;
+            missing.rows = -1;
+            return missing;
+        }
+        Stats::instance().count(Stats::Counter::BandHit);
+        return it->second;
+    }
+
+    // Replaces the bands of the previous export
+    void setBands(Bands bands) {
+        QMutexLocker locker(&mutex);
+        qint64 bytes = 0;
+        for (const auto& band : bands) {
+            bytes += band.second.data.size();
+        }
+        lastBands = bytes <= budget / 2 ? std::move(bands) : Bands();
+        evict();
+    }
+
+    // Tiles, collage and bands together
+    qint64 memoryUsage() {
+        QMutexLocker locker(&mutex);
+        return tileBytes + lastCanvas.image.sizeInBytes() + bandBytes();
+    }
+
+    void clear() {
+        QMutexLocker locker(&mutex);
+        tiles.clear();
+        lru.clear();
+        tileBytes = 0;
+        lastCanvas = Canvas();
+        lastBands.clear();
+    }
+
+private:
+    struct Entry {
+        QImage image;
+        std::list<QString>::iterator lruPos;
+    };
+
+    QMutex mutex;
+    qint64 budget;
+    qint64 tileBytes = 0;
+    std::list<QString> lru;  // most recently used first
+    std::map<QString, Entry> tiles;
+    Canvas lastCanvas;
+    Bands lastBands;
+
+    qint64 bandBytes() const {
+        qint64 bytes = 0;
+        for (const auto& band : lastBands) {
+            bytes += band.second.data.size();
+        }
+        return bytes;
+    }
+
+    // Tiles give way to the collage and bands of the last export
+    void evict() {
+        const qint64 tileBudget = budget - lastCanvas.image.sizeInBytes() - bandBytes();
+        while (tileBytes > tileBudget && !lru.empty()) {
+            auto it = tiles.find(lru.back());
+            tileBytes -= it->second.image.sizeInBytes();
+            tiles.erase(it);
+            lru.pop_back();
+        }
+    }
+};
@@ -0,0 +1,602 @@
+#pragma once
+
+#include <QImage>
+#include <QRect>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <utility>
+#include <vector>
+
+#include "pixelpool.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define COLLAGE_RESAMPLER_X86
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define COLLAGE_RESAMPLER_NEON
+#include <arm_neon.h>
+#endif
+
+// GCC and Clang only emit AVX2 inside functions marked for it, the rest of
+// the file stays baseline so it runs on any x86 CPU
+#if defined(COLLAGE_RESAMPLER_X86) && (defined(__GNUC__) || defined(__clang__))
+#define COLLAGE_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define COLLAGE_TARGET_AVX2
+#endif
+
+// Separable two-pass downscaler for 32-bit pixels: a horizontal pass over
+// the source rows into a narrow intermediate, then a vertical pass straight
+// into the destination. Weights are 14-bit fixed point, so both passes run
+// as 16-bit multiply-adds: AVX2 on x86 when the CPU has it (checked once at
+// runtime), NEON on ARM, plain C++ otherwise. Each kernel is also
+// instantiated for the tap counts of the usual filters and scale factors,
+// where its loops unroll completely; a tile picks one of those once, from
+// its tap counts and row format.
+class Resampler {
+public:
+    enum class Filter { Box, Bicubic, Lanczos3 };
+
+    // Layout of the 32-bit rows handed to resampleRows
+    enum class RowFormat {
+        Rgb32,          // 0xffRRGGBB
+        Rgbx32,         // 0x??RRGGBB, the top byte is padding (BMP)
+        Premultiplied   // ARGB32_Premultiplied, comes out blended over white
+    };
+
+    // Row y of the source region, counted from its top: inWidth pixels,
+    // either in memory of the source's own or written to scratch, which has
+    // room for inWidth pixels. Each row is asked for once, top to bottom.
+    using RowSource = std::function<const uint32_t*(int y, uint32_t* scratch)>;
+
+    // The largest rect of the aspect ratio of aspect centered in size: the
+    // part of a source that fills a tile of that shape
+    static QRect centerRect(const QSize& size, const QSize& aspect) {
+        if (aspect.isEmpty() || size.isEmpty()) {
+            return QRect(QPoint(0, 0), size);
+        }
+        const qint64 width = size.width();
+        const qint64 height = size.height();
+        if (width * aspect.height() > height * aspect.width()) {
+            const int cropWidth = static_cast<int>((height * aspect.width() * 2 + aspect.height()) / (aspect.height() * 2));
+            return QRect((size.width() - cropWidth) / 2, 0, std::max(cropWidth, 1), size.height());
+        }
+        const int cropHeight = static_cast<int>((width * aspect.height() * 2 + aspect.width()) / (aspect.width() * 2));
+        return QRect(0, (size.height() - cropHeight) / 2, size.width(), std::max(cropHeight, 1));
+    }
+
+    // Resamples sourceRect of source into the whole of dest. dest must be
+    // Format_RGB32 and may be a view into a larger canvas. Sources with alpha
+    // come out blended over white, like painting them on the white canvas.
+    static void resample(const QImage& source, const QRect& sourceRect, QImage& dest,
+                         Filter filter = Filter::Lanczos3) {
+        const bool alpha = source.hasAlphaChannel();
+        QImage converted;
+        const uchar* origin;
+        int stride;
+        if (source.format() == QImage::Format_RGB32 || source.format() == QImage::Format_ARGB32_Premultiplied) {
+            // Read the rect in place
+            origin = source.constScanLine(sourceRect.top()) + static_cast<size_t>(sourceRect.left()) * 4;
+            stride = source.bytesPerLine();
+        } else {
+            converted = source.copy(sourceRect).convertToFormat(
+                alpha ? QImage::Format_ARGB32_Premultiplied : QImage::Format_RGB32);
+            origin = converted.constBits();
+            stride = converted.bytesPerLine();
+        }
+        resampleRows([origin, stride](int y, uint32_t*) {
+                         return reinterpret_cast<const uint32_t*>(origin + static_cast<size_t>(y) * stride);
+                     },
+                     sourceRect.width(), sourceRect.height(), alpha ? RowFormat::Premultiplied : RowFormat::Rgb32,
+                     dest, filter);
+    }
+
+    // resample for sources that are not a QImage, such as the strips of a
+    // memory-mapped file: only the rows some output row needs are asked for
+    static void resampleRows(const RowSource& row, int inWidth, int inHeight, RowFormat format, QImage& dest,
+                             Filter filter = Filter::Lanczos3) {
+        const int outWidth = dest.width();
+        const int outHeight = dest.height();
+        PixelPool::Buffer rowScratch = PixelPool::instance().acquire(static_cast<size_t>(inWidth) * sizeof(uint32_t));
+        uint32_t* scratchRow = reinterpret_cast<uint32_t*>(rowScratch.data());
+
+        if (inWidth == outWidth && inHeight == outHeight && format != RowFormat::Premultiplied) {
+            for (int y = 0; y < outHeight; y++) {
+                uint32_t* line = reinterpret_cast<uint32_t*>(dest.scanLine(y));
+                memcpy(line, row(y, scratchRow), static_cast<size_t>(outWidth) * 4);
+                if (format == RowFormat::Rgbx32) {
+                    makeOpaque(line, outWidth);
+                }
+            }
+            return;
+        }
+
+        const Coefficients horizontal = coefficients(inWidth, outWidth, filter);
+        const Coefficients vertical = coefficients(inHeight, outHeight, filter);
+        const Kernels& kernels = activeKernels();
+        const Kernels::Horizontal horizontalKernel = kernels.horizontalFor(horizontal.taps);
+        const Kernels::Vertical verticalKernel = kernels.verticalFor(vertical.taps);
+
+        // Only the source rows some output row reads
+        const int firstRow = vertical.first.front();
+        const int lastRow = vertical.first.back() + vertical.taps;
+        // Scratch of about the source's size per tile: recycled, not allocated
+        PixelPool::Buffer scratch = PixelPool::instance().acquire(
+            static_cast<size_t>(lastRow - firstRow) * outWidth * sizeof(uint32_t));
+        uint32_t* intermediate = reinterpret_cast<uint32_t*>(scratch.data());
+        for (int y = firstRow; y < lastRow; y++) {
+            horizontalKernel(row(y, scratchRow), intermediate + static_cast<size_t>(y - firstRow) * outWidth,
+                             outWidth, horizontal);
+        }
+
+        switch (format) {
+        case RowFormat::Rgb32:
+            verticalPass<RowFormat::Rgb32>(intermediate, firstRow, vertical, verticalKernel, dest);
+            break;
+        case RowFormat::Rgbx32:
+            verticalPass<RowFormat::Rgbx32>(intermediate, firstRow, vertical, verticalKernel, dest);
+            break;
+        case RowFormat::Premultiplied:
+            verticalPass<RowFormat::Premultiplied>(intermediate, firstRow, vertical, verticalKernel, dest);
+            break;
+        }
+    }
+
+    // The whole of source resampled to width x height, as Format_RGB32 in
+    // PixelPool memory
+    static QImage scaled(const QImage& source, int width, int height, Filter filter = Filter::Lanczos3) {
+        QImage result = PixelPool::instance().image(width, height, QImage::Format_RGB32);
+        resample(source, source.rect(), result, filter);
+        return result;
+    }
+
+    // "lanczos3", "bicubic" or "box", as used on the command line
+    static bool filterFromName(const QString& name, Filter* filter) {
+        if (name == "lanczos3") *filter = Filter::Lanczos3;
+        else if (name == "bicubic") *filter = Filter::Bicubic;
+        else if (name == "box") *filter = Filter::Box;
+        else return false;
+        return true;
+    }
+
+    static const char* filterName(Filter filter) {
+        switch (filter) {
+        case Filter::Box: return "box";
+        case Filter::Bicubic: return "bicubic";
+        case Filter::Lanczos3: return "lanczos3";
+        }
+        return "lanczos3";
+    }
+
+    // Which kernels resample() runs on this machine
+    static const char* backendName() {
+        return activeKernels().name;
+    }
+
+private:
+    static constexpr int precisionBits = 14;
+
+    // For each output pixel: taps source pixels starting at first[i], with
+    // weights[i * taps + k]. Windows are shifted inward at the edges so every
+    // tap is a valid source index and SIMD loads never leave the row.
+    struct Coefficients {
+        int taps = 0;
+        std::vector<int> first;
+        std::vector<int16_t> weights;
+    };
+
+    // Filter radius in half source pixels, indexed by Filter
+    static constexpr int supportHalves[] = {1, 4, 6};
+
+    static double filterSupport(Filter filter) {
+        return supportHalves[static_cast<int>(filter)] / 2.0;
+    }
+
+    // Taps coefficients() gives filter at an integer downscale factor
+    static constexpr int integerScaleTaps(Filter filter, int factor) {
+        return (supportHalves[static_cast<int>(filter)] * factor + 1) / 2 * 2 + 1;
+    }
+
+    // Tap counts with kernels of their own: every filter when enlarging and
+    // at factors 2 to 4, non-integer factors often land on them too
+    using FixedTaps = std::integer_sequence<int, 3, 5, 7, 9, 13, 17, 19, 25>;
+    static constexpr int fixedTaps[] = {3, 5, 7, 9, 13, 17, 19, 25};
+    static constexpr size_t fixedTapCount = sizeof(fixedTaps) / sizeof(fixedTaps[0]);
+
+    static constexpr int fixedTapIndex(int taps) {
+        for (size_t i = 0; i < fixedTapCount; i++) {
+            if (fixedTaps[i] == taps) {
+                return static_cast<int>(i);
+            }
+        }
+        return -1;
+    }
+
+    static constexpr bool fixedForFactors(Filter filter) {
+        for (int factor = 1; factor <= 4; factor++) {
+            if (fixedTapIndex(integerScaleTaps(filter, factor)) < 0) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static double sinc(double x) {
+        if (x == 0.0) {
+            return 1.0;
+        }
+        x *= 3.14159265358979323846;
+        return std::sin(x) / x;
+    }
+
+    static double filterWeight(Filter filter, double x) {
+        switch (filter) {
+        case Filter::Box:
+            return x >= -0.5 && x < 0.5 ? 1.0 : 0.0;
+        case Filter::Bicubic: {
+            // Keys cubic, a = -0.5
+            const double a = -0.5;
+            x = std::fabs(x);
+            if (x < 1.0) return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+            if (x < 2.0) return (((x - 5.0) * x + 8.0) * x - 4.0) * a;
+            return 0.0;
+        }
+        case Filter::Lanczos3:
+            return x > -3.0 && x < 3.0 ? sinc(x) * sinc(x / 3.0) : 0.0;
+        }
+        return 0.0;
+    }
+
+    static Coefficients coefficients(int inSize, int outSize, Filter filter) {
+        const double scale = static_cast<double>(inSize) / outSize;
+        const double filterScale = std::max(scale, 1.0);
+        const double support = filterSupport(filter) * filterScale;
+
+        Coefficients result;
+        result.taps = std::min(static_cast<int>(std::ceil(support)) * 2 + 1, inSize);
+        result.first.resize(static_cast<size_t>(outSize));
+        result.weights.assign(static_cast<size_t>(outSize) * result.taps, 0);
+
+        std::vector<double> window(static_cast<size_t>(result.taps));
+        for (int i = 0; i < outSize; i++) {
+            const double center = (i + 0.5) * scale;
+            const int begin = std::max(static_cast<int>(center - support + 0.5), 0);
+            const int end = std::min(static_cast<int>(center + support + 0.5), inSize);
+            const int first = std::max(0, std::min(begin, inSize - result.taps));
+
+            std::fill(window.begin(), window.end(), 0.0);
+            double sum = 0.0;
+            for (int x = begin; x < end && x - first < result.taps; x++) {
+                double weight = filterWeight(filter, (x + 0.5 - center) / filterScale);
+                window[static_cast<size_t>(x - first)] = weight;
+                sum += weight;
+            }
+
+            // Rounded weights must still add up to exactly 1.0, otherwise
+            // flat areas drift by one level
+            int16_t* weights = &result.weights[static_cast<size_t>(i) * result.taps];
+            int total = 0;
+            int largest = 0;
+            for (int k = 0; k < result.taps; k++) {
+                double normalized = sum != 0.0 ? window[static_cast<size_t>(k)] / sum : 0.0;
+                weights[k] = static_cast<int16_t>(std::lround(normalized * (1 << precisionBits)));
+                total += weights[k];
+                if (weights[k] > weights[largest]) {
+                    largest = k;
+                }
+            }
+            weights[largest] = static_cast<int16_t>(weights[largest] + (1 << precisionBits) - total);
+            result.first[static_cast<size_t>(i)] = first;
+        }
+        return result;
+    }
+
+    static uint8_t clampChannel(int value) {
+        value >>= precisionBits;
+        return static_cast<uint8_t>(value < 0 ? 0 : value > 255 ? 255 : value);
+    }
+
+    // Premultiplied color over an opaque white background
+    static void blendOverWhite(uint32_t* line, int width) {
+        for (int x = 0; x < width; x++) {
+            uint32_t pixel = line[x];
+            int inverse = 255 - static_cast<int>(pixel >> 24);
+            uint32_t result = 0xff000000u;
+            for (int shift = 0; shift < 24; shift += 8) {
+                int channel = static_cast<int>((pixel >> shift) & 0xff) + inverse;
+                result |= static_cast<uint32_t>(std::min(channel, 255)) << shift;
+            }
+            line[x] = result;
+        }
+    }
+
+    static void makeOpaque(uint32_t* line, int width) {
+        for (int x = 0; x < width; x++) {
+            line[x] |= 0xff000000u;
+        }
+    }
+
+    // Output rows from the intermediate, finished for the source's format
+    template <RowFormat Format, typename Vertical>
+    static void verticalPass(const uint32_t* intermediate, int firstRow, const Coefficients& vertical,
+                             Vertical kernel, QImage& dest) {
+        const int width = dest.width();
+        for (int y = 0; y < dest.height(); y++) {
+            const uint32_t* rows = intermediate + static_cast<size_t>(vertical.first[static_cast<size_t>(y)] - firstRow) * width;
+            uint32_t* line = reinterpret_cast<uint32_t*>(dest.scanLine(y));
+            kernel(rows, width, line, width, &vertical.weights[static_cast<size_t>(y) * vertical.taps], vertical.taps);
+            if constexpr (Format == RowFormat::Premultiplied) {
+                blendOverWhite(line, width);
+            } else if constexpr (Format == RowFormat::Rgbx32) {
+                makeOpaque(line, width);
+            }
+        }
+    }
+
+    // The kernels below take Taps as a template argument, 0 for any count:
+    // with a fixed count the tap loops unroll and the tail checks fold away
+
+    // Filters one source row into outWidth pixels
+    template <int Taps>
+    static void horizontalScalar(const uint32_t* in, uint32_t* out, int outWidth, const Coefficients& c) {
+        const int taps = Taps ? Taps : c.taps;
+        for (int x = 0; x < outWidth; x++) {
+            const uint32_t* pixels = in + c.first[static_cast<size_t>(x)];
+            const int16_t* weights = &c.weights[static_cast<size_t>(x) * taps];
+            int acc[4] = {1 << (precisionBits - 1), 1 << (precisionBits - 1),
+                          1 << (precisionBits - 1), 1 << (precisionBits - 1)};
+            for (int k = 0; k < taps; k++) {
+                for (int ch = 0; ch < 4; ch++) {
+                    acc[ch] += static_cast<int>((pixels[k] >> (ch * 8)) & 0xff) * weights[k];
+                }
+            }
+            out[x] = static_cast<uint32_t>(clampChannel(acc[0])) | static_cast<uint32_t>(clampChannel(acc[1])) << 8 |
+                     static_cast<uint32_t>(clampChannel(acc[2])) << 16 | static_cast<uint32_t>(clampChannel(acc[3])) << 24;
+        }
+    }
+
+    // Combines taps consecutive rows (rowStride pixels apart) into one,
+    // starting at pixel begin
+    template <int Taps>
+    static void verticalScalar(const uint32_t* rows, int rowStride, uint32_t* out, int width,
+                               const int16_t* weights, int taps, int begin = 0) {
+        if (Taps) {
+            taps = Taps;
+        }
+        for (int x = begin; x < width; x++) {
+            int acc[4] = {1 << (precisionBits - 1), 1 << (precisionBits - 1),
+                          1 << (precisionBits - 1), 1 << (precisionBits - 1)};
+            for (int k = 0; k < taps; k++) {
+                uint32_t pixel = rows[static_cast<size_t>(k) * rowStride + x];
+                for (int ch = 0; ch < 4; ch++) {
+                    acc[ch] += static_cast<int>((pixel >> (ch * 8)) & 0xff) * weights[k];
+                }
+            }
+            out[x] = static_cast<uint32_t>(clampChannel(acc[0])) | static_cast<uint32_t>(clampChannel(acc[1])) << 8 |
+                     static_cast<uint32_t>(clampChannel(acc[2])) << 16 | static_cast<uint32_t>(clampChannel(acc[3])) << 24;
+        }
+    }
+
+    template <int Taps>
+    static void verticalScalarRow(const uint32_t* rows, int rowStride, uint32_t* out, int width,
+                                  const int16_t* weights, int taps) {
+        verticalScalar<Taps>(rows, rowStride, out, width, weights, taps);
+    }
+
+#if defined(COLLAGE_RESAMPLER_X86)
+    // Four taps per step: the pixel pairs (0,1) and (2,3) are interleaved by
+    // channel so one madd yields w0*p0 + w1*p1 for every channel
+    template <int Taps>
+    COLLAGE_TARGET_AVX2
+    static void horizontalAvx2(const uint32_t* in, uint32_t* out, int outWidth, const Coefficients& c) {
+        const __m128i pairShuffle = _mm_setr_epi8(0, 4, 1, 5, 2, 6, 3, 7, 8, 12, 9, 13, 10, 14, 11, 15);
+        const __m128i rounding = _mm_set1_epi32(1 << (precisionBits - 1));
+        const int taps = Taps ? Taps : c.taps;
+        const int wide = taps & ~3;
+        for (int x = 0; x < outWidth; x++) {
+            const uint32_t* pixels = in + c.first[static_cast<size_t>(x)];
+            const int16_t* weights = &c.weights[static_cast<size_t>(x) * taps];
+            __m256i acc = _mm256_setzero_si256();
+            for (int k = 0; k < wide; k += 4) {
+                __m128i source = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + k)), pairShuffle);
+                __m128i w = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(weights + k));
+                __m256i w256 = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_shuffle_epi32(w, 0x00)),
+                                                       _mm_shuffle_epi32(w, 0x55), 1);
+                acc = _mm256_add_epi32(acc, _mm256_madd_epi16(_mm256_cvtepu8_epi16(source), w256));
+            }
+            __m128i sum = _mm_add_epi32(_mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1)), rounding);
+            for (int k = wide; k < taps; k++) {
+                __m128i pixel = _mm_cvtepu8_epi32(_mm_cvtsi32_si128(static_cast<int>(pixels[k])));
+                sum = _mm_add_epi32(sum, _mm_mullo_epi32(pixel, _mm_set1_epi32(weights[k])));
+            }
+            sum = _mm_srai_epi32(sum, precisionBits);
+            sum = _mm_packs_epi32(sum, sum);
+            out[x] = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_packus_epi16(sum, sum)));
+        }
+    }
+
+    // Eight pixels per step, two rows per madd: bytes of row k and row k+1
+    // are interleaved, widened to 16 bit and weighted by (w_k, w_k+1)
+    template <int Taps>
+    COLLAGE_TARGET_AVX2
+    static void verticalAvx2(const uint32_t* rows, int rowStride, uint32_t* out, int width,
+                             const int16_t* weights, int taps) {
+        if (Taps) {
+            taps = Taps;
+        }
+        const __m256i zero = _mm256_setzero_si256();
+        const __m256i rounding = _mm256_set1_epi32(1 << (precisionBits - 1));
+        const int wide = width & ~7;
+        for (int x = 0; x < wide; x += 8) {
+            __m256i acc0 = rounding, acc1 = rounding, acc2 = rounding, acc3 = rounding;
+            for (int k = 0; k < taps; k += 2) {
+                const uint32_t* row0 = rows + static_cast<size_t>(k) * rowStride + x;
+                // An odd last row pairs with itself at weight zero
+                const bool pair = k + 1 < taps;
+                const uint32_t* row1 = pair ? row0 + rowStride : row0;
+                uint32_t packed = static_cast<uint32_t>(static_cast<uint16_t>(pair ? weights[k + 1] : 0)) << 16 |
+                                  static_cast<uint16_t>(weights[k]);
+                __m256i w = _mm256_set1_epi32(static_cast<int>(packed));
+
+                __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row0));
+                __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(row1));
+                __m256i low = _mm256_unpacklo_epi8(a, b);
+                __m256i high = _mm256_unpackhi_epi8(a, b);
+                acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(_mm256_unpacklo_epi8(low, zero), w));
+                acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(_mm256_unpackhi_epi8(low, zero), w));
+                acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(_mm256_unpacklo_epi8(high, zero), w));
+                acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(_mm256_unpackhi_epi8(high, zero), w));
+            }
+            // The packs undo the unpacks lane by lane, restoring pixel order
+            __m256i low = _mm256_packs_epi32(_mm256_srai_epi32(acc0, precisionBits), _mm256_srai_epi32(acc1, precisionBits));
+            __m256i high = _mm256_packs_epi32(_mm256_srai_epi32(acc2, precisionBits), _mm256_srai_epi32(acc3, precisionBits));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_packus_epi16(low, high));
+        }
+        verticalScalar<Taps>(rows, rowStride, out, width, weights, taps, wide);
+    }
+
+    static bool cpuHasAvx2() {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        __cpuid(info, 1);
+        const bool osSavesYmm = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+        __cpuidex(info, 7, 0);
+        return osSavesYmm && (info[1] & (1 << 5));
+#else
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+#if defined(COLLAGE_RESAMPLER_NEON)
+    template <int Taps>
+    static void horizontalNeon(const uint32_t* in, uint32_t* out, int outWidth, const Coefficients& c) {
+        const int taps = Taps ? Taps : c.taps;
+        for (int x = 0; x < outWidth; x++) {
+            const uint32_t* pixels = in + c.first[static_cast<size_t>(x)];
+            const int16_t* weights = &c.weights[static_cast<size_t>(x) * taps];
+            int32x4_t acc = vdupq_n_s32(1 << (precisionBits - 1));
+            int k = 0;
+            for (; k + 2 <= taps; k += 2) {
+                int16x8_t pair = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(reinterpret_cast<const uint8_t*>(pixels + k))));
+                acc = vmlal_n_s16(acc, vget_low_s16(pair), weights[k]);
+                acc = vmlal_n_s16(acc, vget_high_s16(pair), weights[k + 1]);
+            }
+            if (k < taps) {
+                uint8x8_t single = vreinterpret_u8_u32(vdup_n_u32(pixels[k]));
+                acc = vmlal_n_s16(acc, vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(single))), weights[k]);
+            }
+            uint16x4_t narrow = vqmovun_s32(vshrq_n_s32(acc, precisionBits));
+            uint8x8_t bytes = vqmovn_u16(vcombine_u16(narrow, narrow));
+            out[x] = vget_lane_u32(vreinterpret_u32_u8(bytes), 0);
+        }
+    }
+
+    template <int Taps>
+    static void verticalNeon(const uint32_t* rows, int rowStride, uint32_t* out, int width,
+                             const int16_t* weights, int taps) {
+        if (Taps) {
+            taps = Taps;
+        }
+        const int wide = width & ~3;
+        for (int x = 0; x < wide; x += 4) {
+            int32x4_t acc[4];
+            for (int i = 0; i < 4; i++) {
+                acc[i] = vdupq_n_s32(1 << (precisionBits - 1));
+            }
+            for (int k = 0; k < taps; k++) {
+                uint8x16_t pixels = vld1q_u8(reinterpret_cast<const uint8_t*>(rows + static_cast<size_t>(k) * rowStride + x));
+                int16x8_t low = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(pixels)));
+                int16x8_t high = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(pixels)));
+                acc[0] = vmlal_n_s16(acc[0], vget_low_s16(low), weights[k]);
+                acc[1] = vmlal_n_s16(acc[1], vget_high_s16(low), weights[k]);
+                acc[2] = vmlal_n_s16(acc[2], vget_low_s16(high), weights[k]);
+                acc[3] = vmlal_n_s16(acc[3], vget_high_s16(high), weights[k]);
+            }
+            uint16x8_t low = vcombine_u16(vqmovun_s32(vshrq_n_s32(acc[0], precisionBits)),
+                                          vqmovun_s32(vshrq_n_s32(acc[1], precisionBits)));
+            uint16x8_t high = vcombine_u16(vqmovun_s32(vshrq_n_s32(acc[2], precisionBits)),
+                                           vqmovun_s32(vshrq_n_s32(acc[3], precisionBits)));
+            vst1q_u8(reinterpret_cast<uint8_t*>(out + x), vcombine_u8(vqmovn_u16(low), vqmovn_u16(high)));
+        }
+        verticalScalar<Taps>(rows, rowStride, out, width, weights, taps, wide);
+    }
+#endif
+
+    // One backend's kernels: any tap count, and one per fixedTaps entry
+    struct Kernels {
+        using Horizontal = void (*)(const uint32_t*, uint32_t*, int, const Coefficients&);
+        using Vertical = void (*)(const uint32_t*, int, uint32_t*, int, const int16_t*, int);
+
+        Horizontal horizontal;
+        Vertical vertical;
+        const char* name;
+        Horizontal fixedHorizontal[fixedTapCount];
+        Vertical fixedVertical[fixedTapCount];
+
+        Horizontal horizontalFor(int taps) const {
+            const int index = fixedTapIndex(taps);
+            return index < 0 ? horizontal : fixedHorizontal[index];
+        }
+
+        Vertical verticalFor(int taps) const {
+            const int index = fixedTapIndex(taps);
+            return index < 0 ? vertical : fixedVertical[index];
+        }
+    };
+
+    template <int... T>
+    static Kernels scalarKernels(std::integer_sequence<int, T...>) {
+        return {&horizontalScalar<0>, &verticalScalarRow<0>, "scalar",
+                {&horizontalScalar<T>...}, {&verticalScalarRow<T>...}};
+    }
+
+#if defined(COLLAGE_RESAMPLER_X86)
+    template <int... T>
+    static Kernels avx2Kernels(std::integer_sequence<int, T...>) {
+        return {&horizontalAvx2<0>, &verticalAvx2<0>, "avx2", {&horizontalAvx2<T>...}, {&verticalAvx2<T>...}};
+    }
+#endif
+
+#if defined(COLLAGE_RESAMPLER_NEON)
+    template <int... T>
+    static Kernels neonKernels(std::integer_sequence<int, T...>) {
+        return {&horizontalNeon<0>, &verticalNeon<0>, "neon", {&horizontalNeon<T>...}, {&verticalNeon<T>...}};
+    }
+#endif
+
+    // COLLAGE_RESAMPLER_SCALAR=1 in the environment forces the portable
+    // kernels, for comparing against the SIMD ones
+    static const Kernels& activeKernels() {
+        static_assert(fixedForFactors(Filter::Box) && fixedForFactors(Filter::Bicubic) &&
+                      fixedForFactors(Filter::Lanczos3), "fixedTaps misses a common tap count");
+        static const Kernels kernels = []() -> Kernels {
+            const char* forceScalar = std::getenv("COLLAGE_RESAMPLER_SCALAR");
+            if (!forceScalar || std::strcmp(forceScalar, "1") != 0) {
+#if defined(COLLAGE_RESAMPLER_X86)
+                if (cpuHasAvx2()) {
+                    return avx2Kernels(FixedTaps());
+                }
+#elif defined(COLLAGE_RESAMPLER_NEON)
+                return neonKernels(FixedTaps());
+#endif
+            }
+            return scalarKernels(FixedTaps());
+        }();
+        return kernels;
+    }
+};
@@ -0,0 +1,393 @@
+#pragma once
+
+#include <QByteArray>
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QImageReader>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QLocalSocket>
+#include <QMetaObject>
+#include <QPointer>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <QThread>
+#include <QThreadPool>
+#include <QUrl>
+#include <QtConcurrent>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include "batch.h"
+#include "collageworker.h"
+
+// Long-lived render service: collage jobs arrive over a local socket and
+// run on one shared pool of workers, with the render cache (and the disk
+// cache, if given) kept warm from one request to the next, so small jobs
+// don't pay for process startup and cold caches. Started by main() with
+// --serve.
+//
+// A client writes one compact JSON manifest per line, in the format
+// BatchRunner reads, plus
+//   "id": anything, echoed in the reply
+//   "priority": higher runs first, default 0
+//   "memoryLimit": MB the job may need at most, default --job-memory
+//   "format": "png" or "jpeg" for a collage sent back, default "png"
+// Relative and file:// source paths are taken as the server's; other URLs
+// are refused. Every job gets one reply line, in order of completion:
+//   {"id": ..., "ok": true, "message": "...", "size": N}
+// followed by the N bytes of the encoded collage when the manifest named
+// no "output" file for the server to write. The collage is encoded to a
+// spool file and streamed from there as the socket drains, so a reply never
+// holds it in memory.
+class RenderServer : public QObject {
+public:
+    struct Settings {
+        QString name = "collage-render";
+        int renderJobs = 2;
+        qint64 memoryBudget = 4096LL * 1024 * 1024;    // all running jobs together
+        qint64 jobMemoryLimit = 2048LL * 1024 * 1024;  // for requests that set none
+        qint64 renderCacheBytes = 1024LL * 1024 * 1024;
+        std::shared_ptr<DiskCache> diskCache;
+    };
+
+    explicit RenderServer(const Settings& settings)
+        : settings(settings), renderCache(std::make_shared<RenderCache>(settings.renderCacheBytes)) {
+        pool.setMaxThreadCount(std::max(1, settings.renderJobs));
+        connect(&server, &QLocalServer::newConnection, this, &RenderServer::accept);
+    }
+
+    // Parses the --serve command line and serves until the process is
+    // stopped
+    static int run(QCoreApplication& app) {
+        QCommandLineParser parser;
+        parser.setApplicationDescription("Сервер сборки коллажей");
+        parser.addHelpOption();
+        QCommandLineOption serveOption("serve", "Режим сервера.");
+        QCommandLineOption socketOption("socket", "Имя локального сокета.", "NAME", "collage-render");
+        QCommandLineOption jobsOption("jobs", "Сколько коллажей собирать одновременно.", "N",
+                                      QString::number(std::max(1, QThread::idealThreadCount() / 4)));
+        QCommandLineOption memoryOption("memory", "Память на все задания сразу, МБ.", "MB", "4096");
+        QCommandLineOption jobMemoryOption("job-memory", "Память на задание по умолчанию, МБ.", "MB", "2048");
+        QCommandLineOption cacheOption("cache-dir", "Каталог кэша тайлов между запусками.", "DIR");
+        parser.addOptions({serveOption, socketOption, jobsOption, memoryOption, jobMemoryOption, cacheOption});
+        parser.process(app);
+
+        Settings settings;
+        settings.name = parser.value(socketOption);
+        settings.renderJobs = parser.value(jobsOption).toInt();
+        settings.memoryBudget = parser.value(memoryOption).toLongLong() * 1024 * 1024;
+        settings.jobMemoryLimit = parser.value(jobMemoryOption).toLongLong() * 1024 * 1024;
+        if (parser.isSet(cacheOption)) {
+            settings.diskCache = std::make_shared<DiskCache>(parser.value(cacheOption), 8LL * 1024 * 1024 * 1024);
+            std::shared_ptr<DiskCache> cache = settings.diskCache;
+            QtConcurrent::run([cache]() { cache->trim(); });
+        }
+
+        RenderServer server(settings);
+        QString error;
+        if (!server.listen(&error)) {
+            QTextStream(stderr) << "Не удалось открыть сокет " << settings.name << ": " << error << "\n";
+            return 1;
+        }
+        QTextStream(stdout) << "Сервер коллажей: " << server.serverName() << "\n";
+        return app.exec();
+    }
+
+    bool listen(QString* error) {
+        if (!spool.isValid()) {
+            *error = "Нет временного каталога";
+            return false;
+        }
+        // A socket left behind by a server that crashed blocks the name
+        if (!server.listen(settings.name) &&
+            !(QLocalServer::removeServer(settings.name) && server.listen(settings.name))) {
+            *error = server.errorString();
+            return false;
+        }
+        return true;
+    }
+
+    QString serverName() const {
+        return server.fullServerName();
+    }
+
+private:
+    struct Request {
+        quint64 order = 0;              // arrival, first come first served within a priority
+        QPointer<QLocalSocket> client;  // null once the client is gone
+        QJsonValue id;
+        int priority = 0;
+        qint64 memoryBytes = 0;         // estimateBytes
+        bool sendBack = false;          // reply with the encoded collage
+        BatchJob job;
+        CollageWorker::CancelToken cancel = std::make_shared<std::atomic<bool>>(false);
+    };
+    using RequestPtr = std::shared_ptr<Request>;
+
+    Settings settings;
+    QLocalServer server;
+    QThreadPool pool;
+    std::shared_ptr<RenderCache> renderCache;
+    // Collages sent back are encoded here first
+    QTemporaryDir spool;
+    std::vector<RequestPtr> queued;
+    std::vector<RequestPtr> running;
+    qint64 runningBytes = 0;
+    quint64 arrivals = 0;
+
+    // A reply waiting for its socket: the header line, then the spool file
+    struct Reply {
+        QByteArray header;
+        std::unique_ptr<QFile> body;
+    };
+    // Replies to a client go out one after the other, never interleaved
+    std::map<QLocalSocket*, std::deque<Reply>> outgoing;
+    static constexpr qint64 sendChunk = 1024 * 1024;
+
+    void accept() {
+        while (QLocalSocket* socket = server.nextPendingConnection()) {
+            connect(socket, &QLocalSocket::readyRead, this, [this, socket]() { readRequests(socket); });
+            connect(socket, &QLocalSocket::bytesWritten, this, [this, socket]() { send(socket); });
+            connect(socket, &QLocalSocket::disconnected, this, [this, socket]() {
+                dropClient(socket);
+                socket->deleteLater();
+            });
+        }
+    }
+
+    void readRequests(QLocalSocket* socket) {
+        while (socket->canReadLine()) {
+            const QByteArray line = socket->readLine().trimmed();
+            if (!line.isEmpty()) {
+                enqueue(socket, line);
+            }
+        }
+        schedule();
+    }
+
+    // Nobody waits for the jobs of a closed connection: queued ones are
+    // dropped, running ones cancelled
+    void dropClient(QLocalSocket* socket) {
+        auto pending = outgoing.find(socket);
+        if (pending != outgoing.end()) {
+            for (Reply& reply : pending->second) {
+                if (reply.body) {
+                    reply.body->remove();
+                }
+            }
+            outgoing.erase(pending);
+        }
+        queued.erase(std::remove_if(queued.begin(), queued.end(), [socket](const RequestPtr& request) {
+            return request->client == socket;
+        }), queued.end());
+        for (const RequestPtr& request : running) {
+            if (request->client == socket) {
+                request->cancel->store(true);
+            }
+        }
+    }
+
+    void enqueue(QLocalSocket* socket, const QByteArray& line) {
+        auto request = std::make_shared<Request>();
+        request->client = socket;
+        request->order = ++arrivals;
+
+        QJsonParseError parseError;
+        const QJsonDocument document = QJsonDocument::fromJson(line, &parseError);
+        if (!document.isObject()) {
+            reply(*request, false, parseError.errorString());
+            return;
+        }
+        const QJsonObject object = document.object();
+        request->id = object.value("id");
+        request->priority = object.value("priority").toInt(0);
+        const qint64 limit = object.contains("memoryLimit")
+            ? static_cast<qint64>(object.value("memoryLimit").toDouble()) * 1024 * 1024
+            : settings.jobMemoryLimit;
+
+        BatchJob& job = request->job;
+        job.manifestPath = QDir::current().filePath("request.json"); // relative paths are the server's
+        QString error;
+        bool ok = BatchRunner::parseJson(line, job, &error) && localPaths(job, &error);
+        request->sendBack = job.outputPath.isEmpty();
+        if (ok && request->sendBack) {
+            job.outputPath = spool.filePath(QString("%1.%2").arg(request->order)
+                                            .arg(object.value("format").toString("png")));
+        }
+        ok = ok && BatchRunner::resolveJob(job, &error);
+        if (ok) {
+            request->memoryBytes = estimateBytes(job);
+            if (request->memoryBytes > limit) {
+                error = QString("Заданию нужно до %1 МБ, больше предела %2 МБ")
+                            .arg(request->memoryBytes / 1048576).arg(limit / 1048576);
+                ok = false;
+            }
+        }
+        if (!ok) {
+            reply(*request, false, error);
+            return;
+        }
+        queued.push_back(request);
+    }
+
+    static bool localPaths(BatchJob& job, QString* error) {
+        for (BatchCell& cell : job.cells) {
+            if (!cell.path.contains("://")) {
+                continue;
+            }
+            const QUrl url(cell.path);
+            if (!url.isLocalFile()) {
+                *error = QString("Поддерживаются только локальные файлы: %1").arg(cell.path);
+                return false;
+            }
+            cell.path = url.toLocalFile();
+        }
+        return true;
+    }
+
+    // Upper bound for a job: the sources the compose decodes at a time, each
+    // at its bound (the worker gets their sizes from the file headers and
+    // decodes lazily), plus the canvas and the encoder's copy of it, or one
+    // band for a streamed collage. The encoded file goes to disk either way.
+    static qint64 estimateBytes(const BatchJob& job) {
+        const QSize outputSize(job.width, job.height);
+        const QSize bound = CollageWorker::sourceBound(job.rows, job.cols, job.maxSize, outputSize);
+        const CollageWorker::Layout layout = CollageWorker::planLayout(job.rows, job.cols, job.maxSize, outputSize,
+                                                                       bound.width());
+        const qint64 sources = std::min<qint64>(static_cast<qint64>(job.cells.size()),
+                                                std::max(1, QThread::idealThreadCount()));
+        const qint64 sourceBytes = sources * bound.width() * bound.height() * 4;
+        const qint64 canvasBytes = static_cast<qint64>(layout.width()) * layout.height() * 4;
+        if (CollageWorker::isStreamed(layout, CollageWorker::formatForPath(job.outputPath))) {
+            return sourceBytes + static_cast<qint64>(layout.width()) * layout.tile.height() * 4;
+        }
+        return sourceBytes + canvasBytes * 2;
+    }
+
+    // Highest priority first. A job waits while the running ones hold too
+    // much of the memory budget, unless nothing runs at all.
+    void schedule() {
+        while (static_cast<int>(running.size()) < pool.maxThreadCount() && !queued.empty()) {
+            auto next = std::min_element(queued.begin(), queued.end(), [](const RequestPtr& a, const RequestPtr& b) {
+                return a->priority != b->priority ? a->priority > b->priority : a->order < b->order;
+            });
+            RequestPtr request = *next;
+            if (!running.empty() && runningBytes + request->memoryBytes > settings.memoryBudget) {
+                return;
+            }
+            queued.erase(next);
+            running.push_back(request);
+            runningBytes += request->memoryBytes;
+            QtConcurrent::run(&pool, [this, request]() { render(request); });
+        }
+    }
+
+    // Runs on a pool thread; the result goes back to the server's thread
+    void render(const RequestPtr& request) {
+        const BatchJob& job = request->job;
+        ImageStore images(job.rows, job.cols);
+        for (const BatchCell& cell : job.cells) {
+            // The header is enough to plan, tiles in the warm cache are
+            // never decoded at all
+            const QSize size = QImageReader(cell.path).size();
+            images.set(cell.row, cell.col, {cell.path, QImage(), size.isValid() ? std::min(size.width(), size.height()) : 0});
+        }
+
+        CollageWorker::EncodeOptions options = CollageWorker::encodeOptions(
+            CollageWorker::presetFromName(job.preset), CollageWorker::formatForPath(job.outputPath));
+        CollageWorker worker(images, job.maxSize, job.outputPath, options, request->cancel);
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+        Resampler::filterFromName(job.filter, &filter);
+        worker.setFilter(filter);
+        worker.setOutputSize(QSize(job.width, job.height));
+        worker.setRenderCache(renderCache);
+        worker.setDiskCache(settings.diskCache);
+        bool ok = false;
+        QString message;
+        // No event loop here: the lambda is called directly from process()
+        QObject::connect(&worker, &CollageWorker::finished, [&](bool success, QString text) {
+            ok = success;
+            message = text;
+        });
+        worker.process();
+
+        QMetaObject::invokeMethod(this, [this, request, ok, message]() {
+            finish(request, ok, message);
+        }, Qt::QueuedConnection);
+    }
+
+    void finish(const RequestPtr& request, bool ok, const QString& message) {
+        running.erase(std::find(running.begin(), running.end(), request));
+        runningBytes -= request->memoryBytes;
+        reply(*request, ok, message);
+        schedule();
+    }
+
+    // Queues the header line and, for a collage sent back, its spool file
+    void reply(const Request& request, bool ok, QString message) {
+        std::unique_ptr<QFile> body;
+        if (request.sendBack) {
+            body.reset(new QFile(request.job.outputPath));
+            if (!request.client || !ok) {
+                body->remove();
+                body.reset();
+            } else if (!body->open(QIODevice::ReadOnly)) {
+                ok = false;
+                message = body->errorString();
+                body->remove();
+                body.reset();
+            }
+        }
+        if (!request.client) {
+            return;
+        }
+        QJsonObject header;
+        header.insert("id", request.id);
+        header.insert("ok", ok);
+        header.insert("message", message);
+        header.insert("size", static_cast<double>(body ? body->size() : 0));
+        QLocalSocket* socket = request.client.data();
+        outgoing[socket].push_back({QJsonDocument(header).toJson(QJsonDocument::Compact) + "\n", std::move(body)});
+        send(socket);
+    }
+
+    // Keeps about one chunk in the socket's buffer, whatever the size of the
+    // collages waiting for it; bytesWritten calls it again
+    void send(QLocalSocket* socket) {
+        auto pending = outgoing.find(socket);
+        if (pending == outgoing.end()) {
+            return;
+        }
+        std::deque<Reply>& replies = pending->second;
+        while (!replies.empty() && socket->bytesToWrite() < sendChunk) {
+            Reply& reply = replies.front();
+            if (!reply.header.isEmpty()) {
+                socket->write(reply.header);
+                reply.header.clear();
+            } else if (reply.body && !reply.body->atEnd()) {
+                const QByteArray chunk = reply.body->read(sendChunk);
+                if (chunk.isEmpty()) {
+                    // The client can't tell a short reply from a slow one
+                    socket->abort();
+                    return;
+                }
+                socket->write(chunk);
+            } else {
+                if (reply.body) {
+                    reply.body->remove();
+                }
+                replies.pop_front();
+            }
+        }
+        if (replies.empty()) {
+            outgoing.erase(pending);
+        }
+    }
+};
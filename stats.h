@@ -0,0 +1,184 @@
+#pragma once
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QSaveFile>
+#include <QString>
+#include <QTextStream>
+#include <atomic>
+#include <cstdlib>
+#include <vector>
+
+// Process-wide counters for the hot paths: calls, time, pixels and bytes per
+// stage plus cache hits and misses. Relaxed atomics only, so they stay on in
+// production. With COLLAGE_TRACE=<file> in the environment every timed scope
+// is also recorded, and writeTrace() dumps them in the Chrome trace event
+// format for chrome://tracing or Perfetto.
+class Stats {
+public:
+    enum class Stage { Decode, Thumbnail, Resample, Paint, GpuCompose, Encode, Save, Count };
+    enum class Counter { TileHit, TileMiss, BandHit, BandMiss, ThumbnailHit, ThumbnailMiss, DiskHit, DiskMiss, PoolHit, PoolMiss, Count };
+
+    struct Totals {
+        qint64 calls = 0;
+        qint64 nanos = 0;
+        qint64 pixels = 0;
+        qint64 bytes = 0;
+    };
+
+    static Stats& instance() {
+        static Stats stats;
+        return stats;
+    }
+
+    static const char* stageName(Stage stage) {
+        switch (stage) {
+        case Stage::Decode: return "decode";
+        case Stage::Thumbnail: return "thumbnail";
+        case Stage::Resample: return "resample";
+        case Stage::Paint: return "paint";
+        case Stage::GpuCompose: return "gpu compose";
+        case Stage::Encode: return "encode";
+        case Stage::Save: return "save";
+        case Stage::Count: break;
+        }
+        return "";
+    }
+
+    // Nanoseconds since the process started counting
+    qint64 now() const { return clock.nsecsElapsed(); }
+
+    void add(Stage stage, qint64 start, qint64 nanos, qint64 pixels, qint64 bytes) {
+        Slot& slot = stages[static_cast<size_t>(stage)];
+        slot.calls.fetch_add(1, std::memory_order_relaxed);
+        slot.nanos.fetch_add(nanos, std::memory_order_relaxed);
+        slot.pixels.fetch_add(pixels, std::memory_order_relaxed);
+        slot.bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if (tracing) {
+            QMutexLocker locker(&traceMutex);
+            if (events.size() < maxEvents) {
+                events.push_back({stage, start, nanos, pixels, bytes, threadId()});
+            }
+        }
+    }
+
+    void count(Counter counter, qint64 n = 1) {
+        counters[static_cast<size_t>(counter)].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    Totals totals(Stage stage) const {
+        const Slot& slot = stages[static_cast<size_t>(stage)];
+        Totals totals;
+        totals.calls = slot.calls.load(std::memory_order_relaxed);
+        totals.nanos = slot.nanos.load(std::memory_order_relaxed);
+        totals.pixels = slot.pixels.load(std::memory_order_relaxed);
+        totals.bytes = slot.bytes.load(std::memory_order_relaxed);
+        return totals;
+    }
+
+    qint64 counter(Counter counter) const {
+        return counters[static_cast<size_t>(counter)].load(std::memory_order_relaxed);
+    }
+
+    // Hits in percent of all lookups, -1 before the first one
+    int hitRate(Counter hit, Counter miss) const {
+        const qint64 hits = counter(hit);
+        const qint64 lookups = hits + counter(miss);
+        return lookups == 0 ? -1 : static_cast<int>(hits * 100 / lookups);
+    }
+
+    bool isTracing() const { return tracing; }
+
+    // Writes everything recorded so far to the COLLAGE_TRACE file, replacing
+    // it. False when not tracing or on a write error.
+    bool writeTrace() {
+        if (!tracing) {
+            return false;
+        }
+        QSaveFile file(tracePath);
+        if (!file.open(QIODevice::WriteOnly)) {
+            return false;
+        }
+        QTextStream out(&file);
+        out << "{\"traceEvents\":[";
+        QMutexLocker locker(&traceMutex);
+        for (size_t i = 0; i < events.size(); i++) {
+            const Event& event = events[i];
+            out << (i ? ",\n" : "\n")
+                << "{\"name\":\"" << stageName(event.stage) << "\",\"cat\":\"collage\",\"ph\":\"X\""
+                << ",\"ts\":" << QString::number(event.start / 1000.0, 'f', 3)
+                << ",\"dur\":" << QString::number(event.nanos / 1000.0, 'f', 3)
+                << ",\"pid\":1,\"tid\":" << event.thread
+                << ",\"args\":{\"pixels\":" << event.pixels << ",\"bytes\":" << event.bytes << "}}";
+        }
+        out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+        out.flush();
+        return file.commit();
+    }
+
+private:
+    struct Slot {
+        std::atomic<qint64> calls{0};
+        std::atomic<qint64> nanos{0};
+        std::atomic<qint64> pixels{0};
+        std::atomic<qint64> bytes{0};
+    };
+
+    struct Event {
+        Stage stage;
+        qint64 start;
+        qint64 nanos;
+        qint64 pixels;
+        qint64 bytes;
+        int thread;
+    };
+
+    // About 50 MB of events, a trace of a long session stops growing there
+    static constexpr size_t maxEvents = 1000000;
+
+    QElapsedTimer clock;
+    Slot stages[static_cast<size_t>(Stage::Count)];
+    std::atomic<qint64> counters[static_cast<size_t>(Counter::Count)] = {};
+    QString tracePath;
+    bool tracing = false;
+    QMutex traceMutex;
+    std::vector<Event> events;
+
+    Stats() {
+        clock.start();
+        const char* path = std::getenv("COLLAGE_TRACE");
+        tracePath = path ? QString::fromLocal8Bit(path) : QString();
+        tracing = !tracePath.isEmpty();
+    }
+
+    // Small stable numbers read better in the trace viewer than thread handles
+    static int threadId() {
+        static std::atomic<int> next{0};
+        thread_local int id = ++next;
+        return id;
+    }
+};
+
+// Times the enclosing block as one call of its stage
+class StatsScope {
+public:
+    explicit StatsScope(Stats::Stage stage, qint64 pixels = 0, qint64 bytes = 0)
+        : stage(stage), pixels(pixels), bytes(bytes), start(Stats::instance().now()) {}
+
+    ~StatsScope() {
+        Stats& stats = Stats::instance();
+        stats.add(stage, start, stats.now() - start, pixels, bytes);
+    }
+
+    StatsScope(const StatsScope&) = delete;
+    StatsScope& operator=(const StatsScope&) = delete;
+
+    void setPixels(qint64 value) { pixels = value; }
+    void setBytes(qint64 value) { bytes = value; }
+
+private:
+    Stats::Stage stage;
+    qint64 pixels;
+    qint64 bytes;
+    qint64 start;
+};
@@ -0,0 +1,532 @@
+// collage_regression: one scenario of the regression suite, run by CTest.
+//
+// Generates the scenario's sources, writes a manifest for them and renders
+// it through BatchPipeline and CollageWorker the way --batch does. Then
+//  - compares the collage with a collage built independently with Qt,
+//    which catches misplaced, shifted or discolored tiles;
+//  - for the exact scenarios, whose lossless sources are only cropped on
+//    decode, compares it with tests/reference/<scenario>.png, which must
+//    match within --min-psnr dB. The others go through JPEG or Qt's
+//    scaling, which differ between Qt builds, and are checked against Qt
+//    only;
+//  - compares the time per pipeline stage and the peak RSS with
+//    tests/baselines/<scenario>.json, failing on a regression past the
+//    tolerances.
+// A missing reference or baseline fails.
+//
+// Nothing is written unless asked. --record-reference renders an exact
+// scenario's reference from its sources with Resampler alone, without
+// BatchPipeline or CollageWorker, so the pipeline is never compared with
+// itself; run it for every exact scenario after an intended change of
+// output:
+//   collage_regression --data tests --scenario NAME --record-reference
+// --record-baseline replaces the baseline with this run's measurements.
+// The committed baselines are ceilings for the CI runners, not timings of
+// one machine; record them anew when the runners or the budget change.
+//
+// Exit status 0 passes, 1 fails, 77 skips (no image plugin to write the
+// scenario's sources).
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QImage>
+#include <QImageWriter>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QPainter>
+#include <QSaveFile>
+#include <QTemporaryDir>
+#include <QTextStream>
+#include <algorithm>
+#include <map>
+#include <vector>
+
+#include "batch.h"
+#include "benchsupport.h"
+
+namespace {
+
+struct Source {
+    int width;
+    int height;
+    const char* suffix;
+    bool alpha = false;  // alpha falling off from left to right
+};
+
+struct Scenario {
+    const char* name;
+    int rows;
+    int cols;
+    int width;              // exact output size, 0 x 0 to plan it from 4000 px
+    int height;
+    const char* output;     // suffix of the collage
+    // Lossless sources that are only cropped on decode, never scaled by Qt:
+    // the collage is exactly reproducible and tests/reference must hold it
+    bool exact;
+    std::vector<Source> sources;  // cycled through the cells
+};
+
+// Kept in sync with COLLAGE_REGRESSION_SCENARIOS in CMakeLists.txt
+const std::vector<Scenario>& scenarios() {
+    static const std::vector<Scenario> list = {
+        {"grid1", 1, 1, 0, 0, "png", false, {{1600, 1200, "jpg"}}},
+        {"grid3", 3, 3, 0, 0, "png", false,
+         {{1600, 1200, "jpg"}, {1920, 1080, "jpg"}, {1200, 1200, "jpg"}, {1000, 1500, "jpg"}}},
+        {"grid10", 10, 10, 0, 0, "png", false, {{640, 480, "jpg"}, {480, 640, "jpg"}}},
+        {"rows2_cols5", 2, 5, 1000, 240, "png", true, {{150, 100, "png"}, {100, 150, "png"}}},
+        {"jpeg_output", 3, 3, 0, 0, "jpg", false, {{1600, 1200, "jpg"}, {1000, 1500, "jpg"}}},
+        {"streamed", 1, 42, 8400, 200, "png", true, {{25, 20, "png"}, {20, 25, "png"}}},
+        {"huge", 1, 2, 0, 0, "png", false, {{6000, 5000, "jpg"}, {5000, 6000, "jpg"}}},
+        {"tiny", 4, 4, 0, 0, "png", true, {{8, 8, "png"}, {5, 3, "png"}, {1, 1, "png"}}},
+        {"extreme_aspect", 2, 2, 0, 0, "png", true, {{4000, 40, "png"}, {40, 4000, "png"}}},
+        {"alpha", 2, 2, 0, 0, "png", true, {{300, 200, "png", true}, {200, 300, "png", true}}},
+        {"ext_jpg", 2, 2, 0, 0, "png", false, {{1200, 900, "jpg"}, {900, 1200, "jpg"}}},
+        {"ext_jpeg", 2, 2, 0, 0, "png", false, {{1200, 900, "jpeg"}, {900, 1200, "jpeg"}}},
+        {"ext_png", 2, 2, 0, 0, "png", true, {{300, 200, "png"}, {200, 300, "png"}}},
+        {"ext_bmp", 2, 2, 0, 0, "png", true, {{300, 200, "bmp"}, {200, 300, "bmp"}}},
+        {"ext_gif", 2, 2, 0, 0, "png", true, {{300, 200, "gif"}, {200, 300, "gif"}}},
+        {"ext_tiff", 2, 2, 0, 0, "png", true, {{300, 200, "tiff"}, {200, 300, "tiff"}}},
+        // WebP may be lossy, depending on the plugin
+        {"ext_webp", 2, 2, 0, 0, "png", false, {{1200, 900, "webp"}, {900, 1200, "webp"}}},
+    };
+    return list;
+}
+
+// The stages the baselines time, as summed up by Stats over all threads
+const Stats::Stage timedStages[] = {Stats::Stage::Decode, Stats::Stage::Resample, Stats::Stage::Paint,
+                                    Stats::Stage::Encode, Stats::Stage::Save};
+
+// Below this a collage differs from Qt's rendering by more than filters do
+constexpr double qtMinPsnr = 25.0;
+
+// Qt reads GIF but can't write it. A 3-3-2 palette and a clear code every
+// 250 pixels, before the LZW table needs 10-bit codes: no compression, but
+// any decoder reads it.
+bool writeGif(const QImage& image, const QString& path) {
+    QByteArray out("GIF89a");
+    auto put16 = [&out](int value) {
+        out.append(static_cast<char>(value & 0xff));
+        out.append(static_cast<char>(value >> 8 & 0xff));
+    };
+    put16(image.width());
+    put16(image.height());
+    out.append(static_cast<char>(0xf7)); // global table of 256 colors
+    out.append('\0');
+    out.append('\0');
+    for (int i = 0; i < 256; i++) {
+        out.append(static_cast<char>((i >> 5) * 255 / 7));
+        out.append(static_cast<char>((i >> 2 & 7) * 255 / 7));
+        out.append(static_cast<char>((i & 3) * 255 / 3));
+    }
+    out.append(',');
+    put16(0);
+    put16(0);
+    put16(image.width());
+    put16(image.height());
+    out.append('\0');
+    out.append(static_cast<char>(8)); // minimum code size
+
+    QByteArray data;
+    quint32 bits = 0;
+    int bitCount = 0;
+    auto code = [&](int value) {
+        bits |= static_cast<quint32>(value) << bitCount;
+        for (bitCount += 9; bitCount >= 8; bitCount -= 8) {
+            data.append(static_cast<char>(bits & 0xff));
+            bits >>= 8;
+        }
+    };
+    const int clearCode = 256;
+    const int endCode = 257;
+    int run = 0;
+    code(clearCode);
+    const QImage rgb = image.convertToFormat(QImage::Format_RGB32);
+    for (int y = 0; y < rgb.height(); y++) {
+        const QRgb* line = reinterpret_cast<const QRgb*>(rgb.constScanLine(y));
+        for (int x = 0; x < rgb.width(); x++) {
+            if (run == 250) {
+                code(clearCode);
+                run = 0;
+            }
+            code((qRed(line[x]) >> 5) << 5 | (qGreen(line[x]) >> 5) << 2 | qBlue(line[x]) >> 6);
+            run++;
+        }
+    }
+    code(endCode);
+    if (bitCount > 0) {
+        data.append(static_cast<char>(bits & 0xff));
+    }
+    for (int i = 0; i < data.size(); i += 255) {
+        const int length = std::min(255, data.size() - i);
+        out.append(static_cast<char>(length));
+        out.append(data.mid(i, length));
+    }
+    out.append('\0');
+    out.append(';');
+
+    QFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(out) == out.size();
+}
+
+QImage sourceImage(const Source& source, quint32 seed) {
+    QImage image = syntheticImage(source.width, source.height, seed);
+    if (!source.alpha) {
+        return image;
+    }
+    image = image.convertToFormat(QImage::Format_ARGB32);
+    for (int y = 0; y < image.height(); y++) {
+        QRgb* line = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < image.width(); x++) {
+            line[x] = qRgba(qRed(line[x]), qGreen(line[x]), qBlue(line[x]), 255 - x * 255 / image.width());
+        }
+    }
+    return image;
+}
+
+// False with *skip set when this Qt has no writer for the suffix
+bool writeSource(const Source& source, const QString& path, quint32 seed, bool* skip, QString* error) {
+    const QByteArray suffix(source.suffix);
+    if (suffix == "gif") {
+        if (!writeGif(sourceImage(source, seed), path)) {
+            *error = QString("Не удалось записать %1").arg(path);
+            return false;
+        }
+        return true;
+    }
+    const QByteArray format = suffix == "jpg" ? QByteArray("jpeg") : suffix;
+    if (!QImageWriter::supportedImageFormats().contains(format)) {
+        *skip = true;
+        *error = QString("Qt не умеет записывать %1").arg(QString::fromLatin1(format));
+        return false;
+    }
+    QImageWriter writer(path, format);
+    writer.setQuality(90);
+    if (!writer.write(sourceImage(source, seed))) {
+        *error = writer.errorString();
+        return false;
+    }
+    return true;
+}
+
+// The collage built with Qt alone: the center crop of each source, smooth
+// scaled to its tile and painted over white
+QImage qtCollage(const BatchJob& job, const QSize& size) {
+    QImage canvas(size, QImage::Format_RGB32);
+    canvas.fill(Qt::white);
+    const QSize tile(size.width() / job.cols, size.height() / job.rows);
+    QPainter painter(&canvas);
+    for (const BatchCell& cell : job.cells) {
+        const QImage source(cell.path);
+        const QImage scaled = source.copy(Resampler::centerRect(source.size(), tile))
+                                  .scaled(tile, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+        painter.drawImage(QPoint(cell.col * tile.width(), cell.row * tile.height()), scaled);
+    }
+    painter.end();
+    return canvas;
+}
+
+double imagePsnr(const QImage& a, const QImage& b) {
+    return psnr({a.convertToFormat(QImage::Format_RGB32)}, {b.convertToFormat(QImage::Format_RGB32)});
+}
+
+bool saveJson(const QJsonObject& object, const QString& path) {
+    QSaveFile file(path);
+    return file.open(QIODevice::WriteOnly) && file.write(QJsonDocument(object).toJson()) >= 0 && file.commit();
+}
+
+}  // namespace
+
+class Regression {
+public:
+    Regression(const Scenario& scenario, const QString& dataDir, const QString& workDir)
+        : scenario(scenario), dataDir(dataDir), workDir(workDir), out(stdout), err(stderr) {}
+
+    double minPsnr = 40.0;
+    double timeTolerance = 0.5;    // allowed slowdown, as a fraction of the baseline
+    double memoryTolerance = 0.25;
+    bool recordReference = false;
+    bool recordBaseline = false;
+    QString baselineDir;
+
+    int run() {
+        BatchJob job;
+        QString error;
+        bool skip = false;
+        if (!prepare(job, &skip, &error)) {
+            err << scenario.name << ": " << error << "\n";
+            return skip ? 77 : 1;
+        }
+        if (recordReference) {
+            return writeReference(job) ? 0 : 1;
+        }
+
+        // What the pipeline itself needs, without the generated sources
+        resetPeakRss();
+        const qint64 rssBefore = peakRss();
+        std::vector<Stats::Totals> before;
+        for (Stats::Stage stage : timedStages) {
+            before.push_back(Stats::instance().totals(stage));
+        }
+        bool ok = false;
+        QString message;
+        QElapsedTimer timer;
+        timer.start();
+        BatchPipeline::Settings settings;
+        BatchPipeline(settings).run({job}, [&](const BatchJob&, bool success, const QString& text) {
+            ok = success;
+            message = text;
+        });
+        QJsonObject measured;
+        measured.insert("wall", seconds(timer));
+        for (size_t i = 0; i < before.size(); i++) {
+            const Stats::Totals after = Stats::instance().totals(timedStages[i]);
+            measured.insert(Stats::stageName(timedStages[i]), (after.nanos - before[i].nanos) / 1e9);
+        }
+        measured.insert("peakRssMb", std::max<qint64>(peakRss() - rssBefore, 0) / 1048576.0);
+        if (!ok) {
+            err << scenario.name << ": " << message << "\n";
+            return 1;
+        }
+
+        const QImage collage(job.outputPath);
+        if (collage.isNull()) {
+            err << scenario.name << ": не удалось прочитать " << job.outputPath << "\n";
+            return 1;
+        }
+        bool passed = true;
+        if (job.width > 0 && collage.size() != QSize(job.width, job.height)) {
+            err << scenario.name << QString(": коллаж %1x%2 вместо %3x%4\n")
+                   .arg(collage.width()).arg(collage.height()).arg(job.width).arg(job.height);
+            passed = false;
+        }
+        passed = checkOutput(job, collage) && passed;
+        passed = checkBaseline(measured) && passed;
+        out << scenario.name << ": " << (passed ? "ok" : "FAILED") << " (" << Resampler::backendName() << ")\n";
+        return passed ? 0 : 1;
+    }
+
+private:
+    const Scenario& scenario;
+    QString dataDir;
+    QString workDir;
+    QTextStream out;
+    QTextStream err;
+
+    // Sources and manifest in workDir, read back into job
+    bool prepare(BatchJob& job, bool* skip, QString* error) {
+        BatchJob manifest;
+        manifest.rows = scenario.rows;
+        manifest.cols = scenario.cols;
+        manifest.width = scenario.width;
+        manifest.height = scenario.height;
+        manifest.outputPath = QString("collage.%1").arg(scenario.output);
+        for (size_t i = 0; i < scenario.sources.size(); i++) {
+            const Source& source = scenario.sources[i];
+            const QString name = QString("source%1.%2").arg(i).arg(source.suffix);
+            if (!writeSource(source, QDir(workDir).filePath(name), static_cast<quint32>(i + 1), skip, error)) {
+                return false;
+            }
+        }
+        for (int cell = 0; cell < scenario.rows * scenario.cols; cell++) {
+            const size_t source = static_cast<size_t>(cell) % scenario.sources.size();
+            BatchCell batchCell;
+            batchCell.row = cell / scenario.cols;
+            batchCell.col = cell % scenario.cols;
+            batchCell.path = QString("source%1.%2").arg(source).arg(scenario.sources[source].suffix);
+            manifest.cells.push_back(batchCell);
+        }
+        job.manifestPath = QDir(workDir).filePath("manifest.json");
+        return BatchRunner::writeManifest(manifest, job.manifestPath, error) &&
+               BatchRunner::readManifest(job, error) && BatchRunner::resolveJob(job, error);
+    }
+
+    QString referencePath() const {
+        return QDir(dataDir).filePath(QString("reference/%1.png").arg(scenario.name));
+    }
+
+    // The collage from the sources' pixels and Resampler alone: each source
+    // center-cropped to the shape it is decoded at, then to its tile, and
+    // resampled into the canvas. Only exact scenarios have one, their
+    // decode never scales.
+    QImage referenceCollage(const BatchJob& job, QString* error) const {
+        const QSize outputSize(job.width, job.height);
+        const QSize bound = CollageWorker::sourceBound(job.rows, job.cols, job.maxSize, outputSize);
+        std::map<QString, QImage> decoded;
+        int largestSource = 0;
+        for (const BatchCell& cell : job.cells) {
+            if (decoded.count(cell.path)) {
+                continue;
+            }
+            const QImage source(cell.path);
+            const QRect crop = Resampler::centerRect(source.size(), bound);
+            if (source.isNull() || crop.width() > bound.width() || crop.height() > bound.height()) {
+                *error = QString("%1 масштабируется при чтении").arg(cell.path);
+                return QImage();
+            }
+            decoded[cell.path] = source.copy(crop);
+            largestSource = std::max(largestSource, std::min(source.width(), source.height()));
+        }
+        Resampler::Filter filter = Resampler::Filter::Lanczos3;
+        Resampler::filterFromName(job.filter, &filter);
+        const CollageWorker::Layout layout =
+            CollageWorker::planLayout(job.rows, job.cols, job.maxSize, outputSize, largestSource);
+        QImage canvas(layout.width(), layout.height(), QImage::Format_RGB32);
+        canvas.fill(Qt::white);
+        for (const BatchCell& cell : job.cells) {
+            const QImage& source = decoded[cell.path];
+            QImage tile(canvas.scanLine(cell.row * layout.tile.height()) +
+                            static_cast<size_t>(cell.col) * layout.tile.width() * 4,
+                        layout.tile.width(), layout.tile.height(), canvas.bytesPerLine(), QImage::Format_RGB32);
+            Resampler::resample(source, Resampler::centerRect(source.size(), layout.tile), tile, filter);
+        }
+        return canvas;
+    }
+
+    bool writeReference(const BatchJob& job) {
+        if (!scenario.exact) {
+            err << scenario.name << ": не точный сценарий, эталона у него нет\n";
+            return false;
+        }
+        QString error;
+        const QImage reference = referenceCollage(job, &error);
+        if (reference.isNull()) {
+            err << scenario.name << ": " << error << "\n";
+            return false;
+        }
+        QDir(dataDir).mkpath("reference");
+        if (!reference.save(referencePath(), "png")) {
+            err << scenario.name << ": не удалось записать " << referencePath() << "\n";
+            return false;
+        }
+        out << scenario.name << ": записан эталон " << referencePath() << "\n";
+        return true;
+    }
+
+    bool checkOutput(const BatchJob& job, const QImage& collage) {
+        bool passed = true;
+        const double qtPsnr = imagePsnr(collage, qtCollage(job, collage.size()));
+        out << scenario.name << QString(": %1 dB от Qt\n").arg(qtPsnr, 0, 'f', 1);
+        if (qtPsnr < qtMinPsnr) {
+            err << scenario.name << QString(": %1 dB от коллажа, собранного Qt, нужно не меньше %2\n")
+                   .arg(qtPsnr, 0, 'f', 1).arg(qtMinPsnr);
+            passed = false;
+        }
+        if (!scenario.exact) {
+            return passed;
+        }
+
+        const QImage reference(referencePath());
+        if (reference.isNull()) {
+            err << scenario.name << ": нет эталона " << referencePath() << "\n";
+            return false;
+        }
+        if (reference.size() != collage.size()) {
+            err << scenario.name << QString(": коллаж %1x%2, эталон %3x%4\n")
+                   .arg(collage.width()).arg(collage.height()).arg(reference.width()).arg(reference.height());
+            return false;
+        }
+        const double referencePsnr = imagePsnr(collage, reference);
+        out << scenario.name << QString(": %1 dB от эталона\n").arg(referencePsnr, 0, 'f', 1);
+        if (referencePsnr < minPsnr) {
+            err << scenario.name << QString(": %1 dB от эталона, нужно не меньше %2\n")
+                   .arg(referencePsnr, 0, 'f', 1).arg(minPsnr);
+            passed = false;
+        }
+        return passed;
+    }
+
+    bool checkBaseline(const QJsonObject& measured) {
+        const QString baselinePath = QDir(baselineDir).filePath(QString("%1.json").arg(scenario.name));
+        QFile file(baselinePath);
+        const QJsonObject baseline = file.open(QIODevice::ReadOnly)
+            ? QJsonDocument::fromJson(file.readAll()).object() : QJsonObject();
+        file.close();
+        if (recordBaseline) {
+            QDir().mkpath(baselineDir);
+            if (!saveJson(measured, baselinePath)) {
+                err << scenario.name << ": не удалось записать " << baselinePath << "\n";
+                return false;
+            }
+            out << scenario.name << ": записан базовый замер " << baselinePath << "\n";
+            return true;
+        }
+        if (baseline.isEmpty()) {
+            err << scenario.name << ": нет базового замера " << baselinePath << "\n";
+            return false;
+        }
+
+        bool passed = true;
+        for (auto it = measured.begin(); it != measured.end(); ++it) {
+            if (!baseline.contains(it.key())) {
+                continue;
+            }
+            const bool memory = it.key() == "peakRssMb";
+            const double value = it.value().toDouble();
+            const double recorded = baseline.value(it.key()).toDouble();
+            // The slack keeps stages of a few milliseconds from failing on noise
+            const double limit = memory ? recorded * (1 + memoryTolerance) + 16
+                                        : recorded * (1 + timeTolerance) + 0.05;
+            out << QString("  %1 %2 (базовый %3)\n").arg(it.key(), -10)
+                   .arg(value, 0, 'f', memory ? 1 : 3).arg(recorded, 0, 'f', memory ? 1 : 3);
+            if (value > limit) {
+                err << scenario.name << QString(": %1 %2, больше предела %3\n")
+                       .arg(it.key()).arg(value, 0, 'f', 3).arg(limit, 0, 'f', 3);
+                passed = false;
+            }
+        }
+        return passed;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    QCoreApplication app(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Регрессионный прогон одного сценария по эталонам и базовым замерам");
+    parser.addHelpOption();
+    QCommandLineOption scenarioOption("scenario", "Сценарий.", "NAME");
+    QCommandLineOption listOption("list", "Вывести сценарии.");
+    QCommandLineOption dataOption("data", "Каталог с reference/.", "DIR", "tests");
+    QCommandLineOption baselinesOption("baselines", "Каталог базовых замеров, по умолчанию DIR/baselines.", "DIR");
+    QCommandLineOption recordReferenceOption("record-reference", "Записать эталон точного сценария.");
+    QCommandLineOption recordBaselineOption("record-baseline", "Перезаписать базовый замер этим прогоном.");
+    QCommandLineOption psnrOption("min-psnr", "Наименьший PSNR от эталона, dB.", "DB", "40");
+    QCommandLineOption timeOption("time-tolerance", "Допустимое замедление этапа, доля.", "X", "0.5");
+    QCommandLineOption memoryOption("memory-tolerance", "Допустимый рост пика памяти, доля.", "X", "0.25");
+    parser.addOptions({scenarioOption, listOption, dataOption, baselinesOption, recordReferenceOption, recordBaselineOption,
+                       psnrOption, timeOption, memoryOption});
+    parser.process(app);
+
+    if (parser.isSet(listOption)) {
+        QTextStream out(stdout);
+        for (const Scenario& scenario : scenarios()) {
+            out << scenario.name << "\n";
+        }
+        return 0;
+    }
+    const QString name = parser.value(scenarioOption);
+    auto scenario = std::find_if(scenarios().begin(), scenarios().end(),
+                                 [&name](const Scenario& s) { return name == s.name; });
+    if (scenario == scenarios().end()) {
+        QTextStream(stderr) << "Неизвестный сценарий " << name << "\n";
+        return 1;
+    }
+    QTemporaryDir workDir;
+    if (!workDir.isValid()) {
+        QTextStream(stderr) << "Не удалось создать временную папку\n";
+        return 1;
+    }
+
+    Regression regression(*scenario, parser.value(dataOption), workDir.path());
+    regression.minPsnr = parser.value(psnrOption).toDouble();
+    regression.timeTolerance = parser.value(timeOption).toDouble();
+    regression.memoryTolerance = parser.value(memoryOption).toDouble();
+    regression.recordReference = parser.isSet(recordReferenceOption);
+    regression.recordBaseline = parser.isSet(recordBaselineOption);
+    regression.baselineDir = parser.isSet(baselinesOption) ? parser.value(baselinesOption)
+                                                           : QDir(parser.value(dataOption)).filePath("baselines");
+    return regression.run();
+}